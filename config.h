@@ -1,4 +1,8 @@
-/* config.h - Configuration for slimterm */
+/* config.h - Configuration for slimterm
+ *
+ * Font, colors, border, scrollback and shortcuts can also be set in
+ * $XDG_CONFIG_HOME/slimterm/config, which overrides the values here and
+ * is read again when it changes or slimterm gets SIGHUP. */
 
 /* Terminal type */
 #define TERM_TYPE "xterm-256color"
@@ -10,9 +14,16 @@
 /* Border width */
 #define BORDER_WIDTH 20
 
+/* Lines of scrollback each terminal keeps */
+#define SCROLLBACK_SIZE 1000
+
 /* Font */
 #define FONT_NAME "JetBrainsMono Nerd Font:size=15"
 
+/* Points added or removed by Ctrl+Plus and Ctrl+Minus; Ctrl+0 restores
+ * the size above */
+#define ZOOM_STEP 1
+
 /* Colors */
 const char *colors[] = {
     /* Normal colors (0-7) */
@@ -39,9 +50,61 @@ const char *colors[] = {
 #define DEFAULT_FG 7  /* White */
 #define DEFAULT_BG 0  /* Black */
 
+/* Opacity of the default background, 0 to 1. Below 1 the window gets a
+ * 32-bit visual so a compositor can show what is behind it. */
+#define BACKGROUND_ALPHA 1.0
+
 /* Selection colors (indices into colors array) */
 #define SELECTION_FG 0  /* Black */
 #define SELECTION_BG 7  /* White */
 
+/* Minimum time between redraws while output is arriving, in ms, when
+ * the window has the keyboard focus and when it does not */
+#define FRAME_INTERVAL 8
+#define UNFOCUSED_FRAME_INTERVAL 100
+
+/* What to do when output arrives faster than it can be drawn:
+ * BP_DRAIN    read the PTY as fast as possible, skipping frames
+ * BP_THROTTLE stop reading once PARSE_BUDGET percent of a frame went
+ *             into parsing, so the child blocks on the full PTY
+ * BP_AUTO     throttle only while the terminal is saturated */
+#define BACKPRESSURE BP_AUTO
+#define PARSE_BUDGET 50
+
+/* Discard output not drawn yet when an interrupt, quit or suspend key
+ * is typed, like stty flusho */
+#define FLUSH_ON_INTERRUPT 1
+
+/* Keys reported under modifyOtherKeys: 0 for xterm's CSI 27;mod;code ~,
+ * 1 for CSI code;mod u (xterm formatOtherKeys) */
+#define FORMAT_OTHER_KEYS 0
+
+/* Decoded image data all terminals together keep for display, oldest
+ * images are dropped first */
+#define IMAGE_CACHE_SIZE (64 << 20)
+
+/* Shortcuts: modifiers, key (lower case), action and its argument */
+static const Shortcut shortcuts[] = {
+    {KEYMOD_CTRL | KEYMOD_SHIFT, XK_c, ACT_COPY, 0},
+    {KEYMOD_CTRL | KEYMOD_SHIFT, XK_v, ACT_PASTE, 0},
+    {KEYMOD_CTRL, XK_v, ACT_PASTE, 0},
+    {KEYMOD_SHIFT, XK_Up, ACT_SCROLL, -1},
+    {KEYMOD_SHIFT, XK_Down, ACT_SCROLL, 1},
+    {KEYMOD_CTRL | KEYMOD_SHIFT, XK_t, ACT_NEW_TAB, 0},
+    {KEYMOD_CTRL | KEYMOD_SHIFT, XK_Return, ACT_SPLIT, 0},
+    {KEYMOD_CTRL | KEYMOD_SHIFT, XK_underscore, ACT_SPLIT, 1},
+    {KEYMOD_CTRL | KEYMOD_SHIFT, XK_Right, ACT_SELECT_TAB, 1},
+    {KEYMOD_CTRL | KEYMOD_SHIFT, XK_Left, ACT_SELECT_TAB, -1},
+    {KEYMOD_CTRL | KEYMOD_SHIFT, XK_braceright, ACT_FOCUS_PANE, 1},
+    {KEYMOD_CTRL | KEYMOD_SHIFT, XK_braceleft, ACT_FOCUS_PANE, -1},
+    {KEYMOD_CTRL, XK_equal, ACT_ZOOM, ZOOM_STEP},
+    {KEYMOD_CTRL | KEYMOD_SHIFT, XK_plus, ACT_ZOOM, ZOOM_STEP},
+    {KEYMOD_CTRL, XK_KP_Add, ACT_ZOOM, ZOOM_STEP},
+    {KEYMOD_CTRL, XK_minus, ACT_ZOOM, -ZOOM_STEP},
+    {KEYMOD_CTRL, XK_KP_Subtract, ACT_ZOOM, -ZOOM_STEP},
+    {KEYMOD_CTRL, XK_0, ACT_ZOOM, 0},
+    {KEYMOD_CTRL, XK_KP_0, ACT_ZOOM, 0},
+};
+
 /* Mouse behavior */
 #define MOUSE_SCROLL_LINES 3  /* Number of lines to scroll per mouse wheel tick */
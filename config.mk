@@ -7,6 +7,26 @@ VERSION = 0.1
 CC = gcc
 PREFIX = /usr/local
 
+# io_uring event loop (Linux >= 5.19), comment out to disable
+IOURINGFLAGS = -DIOURING
+
+# Vsync-aligned drawing with the X Present extension, uncomment to enable
+#PRESENTFLAGS = -DPRESENT
+#PRESENTLIBS = -lXpresent
+
+# Read X events through XCB without blocking (needs Xlib-xcb), uncomment
+# to enable; input methods are not supported in this mode
+#XCBFLAGS = -DXCB
+#XCBLIBS = -lX11-xcb -lxcb
+
+# Smooth scrolling with XInput2, uncomment to enable; not used with XCB
+#XINPUT2FLAGS = -DXINPUT2
+#XINPUT2LIBS = -lXi
+
+# PNG and compressed kitty graphics, comment out to disable
+PNGFLAGS = -DPNG
+PNGLIBS = -lpng -lz
+
 # Compiler flags
-CFLAGS = -g -Wall -O2 -I. -I/usr/X11R6/include -I/usr/include/freetype2 -DVERSION=\"$(VERSION)\"
-LDFLAGS = -g -L/usr/X11R6/lib -lX11 -lXft -lfontconfig
+CFLAGS = -g -Wall -O2 -I. -I/usr/X11R6/include -I/usr/include/freetype2 -DVERSION=\"$(VERSION)\" $(IOURINGFLAGS) $(XCBFLAGS) $(PRESENTFLAGS) $(PNGFLAGS) $(XINPUT2FLAGS)
+LDFLAGS = -g -L/usr/X11R6/lib -lX11 -lXft -lXrender -lfontconfig -lm -lrt -lpthread $(XCBLIBS) $(PRESENTLIBS) $(PNGLIBS) $(XINPUT2LIBS)
@@ -2,36 +2,87 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <X11/Xlib.h>
+#include <X11/XKBlib.h>
 #include <X11/keysym.h>
 #include <X11/Xutil.h>
+#include <X11/Xresource.h>
 #include <X11/Xft/Xft.h>
+#include <X11/extensions/Xrender.h>
 #include <X11/Xatom.h>
 
 #if defined(__linux)
 #include <pty.h>
+#include <sys/inotify.h>
+#endif
+
+#ifdef IOURING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcbext.h>
+#endif
+
+#ifdef PRESENT
+#include <X11/extensions/Xpresent.h>
+#endif
+
+#ifdef XCB
+#undef XINPUT2 /* Its events are only read through Xlib */
+#endif
+#ifdef XINPUT2
+#include <X11/extensions/XInput2.h>
+#endif
+
+#ifdef PNG
+#include <png.h>
+#include <zlib.h>
 #endif
 
 #include "slimterm.h"
 #include "config.h"
 
-#define BUFSIZE 1024
+#define BUFSIZE 8192
+#define PARSE_SLICE 1024 /* Bytes parsed between checks for user input */
+#define PRESENT_TIMEOUT 100 /* ms to wait for a lost Present completion */
+#define SELECTION_MAX (1 << 24) /* Largest paste, in bytes */
 #define DEFAULT_SHELL "/bin/bash"
 
+/* Events selected on the window, besides those an input method needs */
+#define XEVENT_MASK (ExposureMask | KeyPressMask | KeyReleaseMask | StructureNotifyMask | \
+                     ButtonPressMask | ButtonReleaseMask | PointerMotionMask | FocusChangeMask)
+
+/* Control string states: DCS, APC and the strings we skip */
+enum { STR_NONE, STR_SIXEL, STR_APC, STR_IGNORE };
+
 /* Utility macros */
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define TIMEDIFF(t1, t2) ((t1.tv_sec - t2.tv_sec) * 1000 + \
+                          (t1.tv_nsec - t2.tv_nsec) / 1E6)
 
 /* Configuration globals */
 char *termname = TERM_TYPE;
@@ -40,21 +91,116 @@ unsigned int defaultbg = DEFAULT_BG;
 unsigned int selection_fg = SELECTION_FG;
 unsigned int selection_bg = SELECTION_BG;
 XWindow xw;
-Term term;
+
+/* Settings the config file overrides, set from config.h when it does
+ * not; see config_load */
+static char *font_name = NULL;
+static char *color_names[16];
+static int border_width = BORDER_WIDTH;
+static int scrollback_size = SCROLLBACK_SIZE;
+static Shortcut binds[MAX_SHORTCUTS];
+static int nbinds = 0;
+static char *config_path = NULL;
+static int config_fd = -1; /* inotify, watching the config file's directory */
+static volatile sig_atomic_t config_reload = 0; /* Set by SIGHUP */
+
+/* Shortcut actions by their name in the config file */
+static const char *action_names[ACT_LAST] = {
+    [ACT_NONE] = "none",
+    [ACT_COPY] = "copy",
+    [ACT_PASTE] = "paste",
+    [ACT_SCROLL] = "scroll",
+    [ACT_NEW_TAB] = "new_tab",
+    [ACT_SPLIT] = "split",
+    [ACT_SELECT_TAB] = "select_tab",
+    [ACT_FOCUS_PANE] = "focus_pane",
+    [ACT_ZOOM] = "zoom",
+};
+
+static Tab tabs[MAX_TABS];
+static int ntabs = 0, curtab = 0;
+static unsigned int term_ids = 0; /* Last terminal id handed out */
 
 /* Global variables */
-static int master_fd = -1; /* Master side of the PTY */
-static pid_t child_pid = -1; /* PID of the shell process */
-static char escape_buf[BUFSIZE];
-static int escape_len = 0;
-static int in_escape = 0;
-static int current_fg = DEFAULT_FG; /* Default foreground color */
-static int current_bg = DEFAULT_BG; /* Default background color */
-static int saved_row = 0; /* For \033[s and \033[u */
-static int saved_col = 0;
-static int wrap = 1; /* Line wrapping enabled by default */
-static int mouse_enabled = 0; /* Mouse reporting disabled by default */
-static int mouse_mode = 0; /* Mouse tracking mode */
+static volatile sig_atomic_t child_exited = 0; /* Set by SIGCHLD */
+static sigset_t orig_sigmask; /* Signal mask to wait for events with */
+static size_t image_bytes = 0; /* Decoded image data of all terminals */
+static unsigned long image_tick = 0; /* Use clock for LRU eviction */
+static const char *shm_name = NULL; /* Name of the published screen segment */
+static ShmScreen *shm = NULL; /* Mapped screen segment, NULL when disabled */
+
+/* Session log: ttyread reads straight into ring slots, a writer thread
+ * drains them to disk so slow storage never stalls the main loop. Each
+ * terminal has its own files; chunks carry the descriptors they go to. */
+static const char *log_name = NULL;
+static const char *log_timing_name = NULL;
+static LogChunk *log_ring;
+static int log_error; /* errno of a failed write, set by the writer */
+static int log_stopped; /* Logging was stopped after log_error */
+static unsigned int log_head; /* Next slot to fill, main thread only */
+static unsigned int log_tail; /* Next slot to write, advanced by writer */
+static int log_quit;
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+/* Frame pacing: PTY output marks the screen dirty and it is drawn at
+ * most once per FRAME_INTERVAL. bp_throttle is the backpressure policy
+ * in effect, which BP_AUTO switches from measured parse/draw times. */
+static int bp_policy = BACKPRESSURE;
+static int bp_throttle = BACKPRESSURE == BP_THROTTLE;
+static int bp_streak = 0; /* Consecutive frames arguing for a switch */
+static int dirty = 0; /* Output parsed but not drawn yet */
+static int badges_stale = 0; /* Only counts of new lines changed */
+static struct timespec last_draw; /* End of the last redraw */
+static double frame_parse_ms = 0; /* Time spent parsing since last_draw */
+
+/* Atoms, interned together at startup */
+static char *atom_names[ATOM_LAST] = {
+    [ATOM_CLIPBOARD] = "CLIPBOARD",
+    [ATOM_RESOURCE_MANAGER] = "RESOURCE_MANAGER",
+};
+
+/* X round trip accounting, enabled with --debug-x */
+static int debug_x = 0;
+static unsigned long x_roundtrips = 0; /* Round trips since the last frame */
+static unsigned long x_last_read = 0; /* Last request Xlib had seen answered */
+static unsigned long x_frame_request = 0; /* First request of the frame */
+
+#ifdef IOURING
+/* io_uring event loop, selected with --io-uring */
+#define UR_ENTRIES 128 /* Room for a read per terminal, the X poll and a timeout */
+#define UR_NBUFS 16 /* Provided PTY read buffers, must be a power of two */
+#define UR_BGID 0
+
+/* Request kinds in the low byte of user_data; PTY reads carry the
+ * terminal id above it */
+enum { UR_PTY = 1, UR_X, UR_WAKE, UR_CONFIG };
+
+static int use_uring = 0;
+static struct {
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int sq_entries;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int sq_local_tail; /* SQEs prepared but not yet published */
+    unsigned int to_submit;
+    struct io_uring_buf_ring *br; /* Provided buffer ring for PTY reads */
+    char *bufs;
+    struct __kernel_timespec wake_ts;
+} ur;
+#endif
+
+/* Forward declarations */
+void ttywrite(Term *term, const char *s, size_t n);
+void xevent(void);
+static void term_scroll_up(Term *term);
+static void term_close(Term *t, int status);
+static int tabs_visible(Term *t);
+static void xhandle(XEvent *ev);
+static int xintr_pending(Term *term);
 
 /* Error handling and termination */
 void die(const char *msg, ...) {
@@ -92,32 +238,99 @@ ssize_t xwrite(int fd, const char *buf, size_t len) {
     return ret;
 }
 
+/* Character sets. A printable byte is stored in its cell as table[byte]
+ * of the set in GL. DEC special graphics go to cell bytes 1-31, where
+ * the VT100 font had them, and national sets to their Latin-1 bytes;
+ * cell_rune maps both back to Unicode. */
+#define CS_ROW(b) b, b + 1, b + 2, b + 3, b + 4, b + 5, b + 6, b + 7, \
+                  b + 8, b + 9, b + 10, b + 11, b + 12, b + 13, b + 14, b + 15
+#define CS_ASCII CS_ROW(0), CS_ROW(16), CS_ROW(32), CS_ROW(48), \
+                 CS_ROW(64), CS_ROW(80), CS_ROW(96), CS_ROW(112)
+
+static const unsigned char cs_ascii[128] = {CS_ASCII};
+static const unsigned char cs_dec[128] = {
+    CS_ROW(0), CS_ROW(16), CS_ROW(32), CS_ROW(48), CS_ROW(64),
+    'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', '[', '\\', ']', '^', ' ',
+    CS_ROW(1), 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127,
+};
+static const unsigned char cs_uk[128] = {CS_ASCII, ['#'] = 0xa3};
+static const unsigned char cs_german[128] = {
+    CS_ASCII, ['@'] = 0xa7, ['['] = 0xc4, ['\\'] = 0xd6, [']'] = 0xdc,
+    ['{'] = 0xe4, ['|'] = 0xf6, ['}'] = 0xfc, ['~'] = 0xdf,
+};
+static const unsigned char cs_french[128] = {
+    CS_ASCII, ['#'] = 0xa3, ['@'] = 0xe0, ['['] = 0xb0, ['\\'] = 0xe7, [']'] = 0xa7,
+    ['{'] = 0xe9, ['|'] = 0xf9, ['}'] = 0xe8, ['~'] = 0xa8,
+};
+static const unsigned char cs_swedish[128] = {
+    CS_ASCII, ['@'] = 0xc9, ['['] = 0xc4, ['\\'] = 0xd6, [']'] = 0xc5, ['^'] = 0xdc,
+    ['`'] = 0xe9, ['{'] = 0xe4, ['|'] = 0xf6, ['}'] = 0xe5, ['~'] = 0xfc,
+};
+
+/* Unicode for cell bytes 1-31, DEC special graphics 0x60-0x7e */
+static const uint16_t dec_graphics[32] = {
+    0, 0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0, 0x00b1,
+    0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c, 0x23ba,
+    0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534, 0x252c,
+    0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7,
+};
+
+/* Latin-1 stand-ins for the same, for the STRING selection. The
+ * control pictures become ?, never the controls they picture, so a
+ * paste cannot run a command. */
+static const char dec_latin1[32] = "\0*#????\xb0\xb1??+++++--"
+                                   "-__++++|<>p#\xa3\xb7";
+
+/* The character a cell byte stands for */
+static uint32_t cell_rune(unsigned char ch) {
+    return ch < 32 ? dec_graphics[ch] : ch;
+}
+
+/* Translation table designated by the final byte of ESC ( and friends.
+ * Unsupported sets are treated as ASCII. */
+static const unsigned char *charset_find(char final) {
+    switch (final) {
+    case '0': return cs_dec;
+    case 'A': return cs_uk;
+    case 'K': return cs_german;
+    case 'R': case 'f': return cs_french;
+    case 'H': case '7': return cs_swedish;
+    default: return cs_ascii;
+    }
+}
+
 /* Initialize the terminal buffer */
-static void term_init(void) {
-    memset(term.data, 0, sizeof(term.data));
-    memset(term.fg, defaultfg, sizeof(term.fg));
-    memset(term.bg, defaultbg, sizeof(term.bg));
-    memset(term.alt_data, 0, sizeof(term.alt_data));
-    memset(term.alt_fg, defaultfg, sizeof(term.alt_fg));
-    memset(term.alt_bg, defaultbg, sizeof(term.alt_bg));
-    memset(term.scrollback, 0, sizeof(term.scrollback));
-    memset(term.scrollback_fg, defaultfg, sizeof(term.scrollback_fg));
-    memset(term.scrollback_bg, defaultbg, sizeof(term.scrollback_bg));
-    term.row = 0;
-    term.col = 0;
-    term.scroll_top = 0;
-    term.scroll_bottom = xw.row - 1;
-    term.scrollback_pos = 0;
-    term.scrollback_len = 0;
-    term.scroll_offset = 0;
-    term.use_alt_buffer = 0;
-    term.alt_row = 0;
-    term.alt_col = 0;
-    term.sel_start_row = -1;
-    term.sel_start_col = -1;
-    term.sel_end_row = -1;
-    term.sel_end_col = -1;
-    term.selecting = 0;
+static void term_init(Term *term) {
+    memset(term->data, 0, sizeof(term->data));
+    memset(term->fg, defaultfg, sizeof(term->fg));
+    memset(term->bg, defaultbg, sizeof(term->bg));
+    memset(term->alt_data, 0, sizeof(term->alt_data));
+    memset(term->alt_fg, defaultfg, sizeof(term->alt_fg));
+    memset(term->alt_bg, defaultbg, sizeof(term->alt_bg));
+    term->row = 0;
+    term->col = 0;
+    term->scroll_top = 0;
+    term->scroll_bottom = term->rows - 1;
+    term->scrollback_pos = 0;
+    term->scrollback_len = 0;
+    term->scroll_offset = 0;
+    term->scroll_frac = 0;
+    term->new_lines = 0;
+    term->use_alt_buffer = 0;
+    term->alt_row = 0;
+    term->alt_col = 0;
+    term->sel_start_row = -1;
+    term->sel_start_col = -1;
+    term->sel_end_row = -1;
+    term->sel_end_col = -1;
+    term->selecting = 0;
+    term->master_fd = -1;
+    term->current_fg = DEFAULT_FG;
+    term->current_bg = DEFAULT_BG;
+    term->wrap = 1;
+    for (int i = 0; i < 4; i++) term->charsets[i] = term->saved_charsets[i] = cs_ascii;
+    term->gl = term->saved_gl = 0;
+    term->single_shift = -1;
 }
 
 /* Clear a line in the terminal buffer */
@@ -130,14 +343,14 @@ static void term_clear_line(int r, char data[][MAX_COLS], int fg[][MAX_COLS], in
 }
 
 /* Clear from the current cursor position to the end of the line */
-static void term_clear_to_eol(void) {
-    char (*data)[MAX_COLS] = term.use_alt_buffer ? term.alt_data : term.data;
-    int (*fg)[MAX_COLS] = term.use_alt_buffer ? term.alt_fg : term.fg;
-    int (*bg)[MAX_COLS] = term.use_alt_buffer ? term.alt_bg : term.bg;
-    int row = term.use_alt_buffer ? term.alt_row : term.row;
-    int col = term.use_alt_buffer ? term.alt_col : term.col;
-
-    for (int c = col; c < xw.col; c++) {
+static void term_clear_to_eol(Term *term) {
+    char (*data)[MAX_COLS] = term->use_alt_buffer ? term->alt_data : term->data;
+    int (*fg)[MAX_COLS] = term->use_alt_buffer ? term->alt_fg : term->fg;
+    int (*bg)[MAX_COLS] = term->use_alt_buffer ? term->alt_bg : term->bg;
+    int row = term->use_alt_buffer ? term->alt_row : term->row;
+    int col = term->use_alt_buffer ? term->alt_col : term->col;
+
+    for (int c = col; c < term->cols; c++) {
         data[row][c] = 0;
         fg[row][c] = defaultfg;
         bg[row][c] = defaultbg;
@@ -145,25 +358,25 @@ static void term_clear_to_eol(void) {
 }
 
 /* Clear from the cursor down */
-static void term_clear_below(void) {
-    char (*data)[MAX_COLS] = term.use_alt_buffer ? term.alt_data : term.data;
-    int (*fg)[MAX_COLS] = term.use_alt_buffer ? term.alt_fg : term.fg;
-    int (*bg)[MAX_COLS] = term.use_alt_buffer ? term.alt_bg : term.bg;
-    int row = term.use_alt_buffer ? term.alt_row : term.row;
-
-    term_clear_to_eol();
-    for (int r = row + 1; r < xw.row; r++) {
+static void term_clear_below(Term *term) {
+    char (*data)[MAX_COLS] = term->use_alt_buffer ? term->alt_data : term->data;
+    int (*fg)[MAX_COLS] = term->use_alt_buffer ? term->alt_fg : term->fg;
+    int (*bg)[MAX_COLS] = term->use_alt_buffer ? term->alt_bg : term->bg;
+    int row = term->use_alt_buffer ? term->alt_row : term->row;
+
+    term_clear_to_eol(term);
+    for (int r = row + 1; r < term->rows; r++) {
         term_clear_line(r, data, fg, bg);
     }
 }
 
 /* Clear from the cursor up */
-static void term_clear_above(void) {
-    char (*data)[MAX_COLS] = term.use_alt_buffer ? term.alt_data : term.data;
-    int (*fg)[MAX_COLS] = term.use_alt_buffer ? term.alt_fg : term.fg;
-    int (*bg)[MAX_COLS] = term.use_alt_buffer ? term.alt_bg : term.bg;
-    int row = term.use_alt_buffer ? term.alt_row : term.row;
-    int col = term.use_alt_buffer ? term.alt_col : term.col;
+static void term_clear_above(Term *term) {
+    char (*data)[MAX_COLS] = term->use_alt_buffer ? term->alt_data : term->data;
+    int (*fg)[MAX_COLS] = term->use_alt_buffer ? term->alt_fg : term->fg;
+    int (*bg)[MAX_COLS] = term->use_alt_buffer ? term->alt_bg : term->bg;
+    int row = term->use_alt_buffer ? term->alt_row : term->row;
+    int col = term->use_alt_buffer ? term->alt_col : term->col;
 
     /* Clear from cursor to beginning of the current line */
     for (int c = 0; c <= col; c++) {
@@ -177,234 +390,1132 @@ static void term_clear_above(void) {
     }
 }
 
-/* Add a line to the scrollback buffer */
-static void term_add_scrollback(int r) {
-    if (term.scrollback_len < SCROLLBACK_SIZE) {
-        term.scrollback_len++;
-    } else {
-        /* Shift scrollback buffer up */
-        for (int i = 0; i < SCROLLBACK_SIZE - 1; i++) {
-            memcpy(term.scrollback[i], term.scrollback[i + 1], MAX_COLS);
-            memcpy(term.scrollback_fg[i], term.scrollback_fg[i + 1], MAX_COLS * sizeof(int));
-            memcpy(term.scrollback_bg[i], term.scrollback_bg[i + 1], MAX_COLS * sizeof(int));
+/* Index in the scrollback ring of line r, counted from the oldest */
+static int scrollback_row(Term *term, int r) {
+    return (term->scrollback_pos - term->scrollback_len + r + term->scrollback_size) % term->scrollback_size;
+}
+
+/* Add a line to the scrollback buffer, over the oldest once it is full.
+ * A view into the history stays on the lines it shows, which are now
+ * one further from the bottom, unless they were the oldest and dropped. */
+static void term_add_scrollback(Term *term, int r) {
+    if (!term->scrollback_size) return;
+    int full = term->scrollback_len == term->scrollback_size;
+    if (!full) term->scrollback_len++;
+    memcpy(term->scrollback[term->scrollback_pos], term->data[r], MAX_COLS);
+    memcpy(term->scrollback_fg[term->scrollback_pos], term->fg[r], MAX_COLS * sizeof(int));
+    memcpy(term->scrollback_bg[term->scrollback_pos], term->bg[r], MAX_COLS * sizeof(int));
+    term->scrollback_pos = (term->scrollback_pos + 1) % term->scrollback_size;
+
+    if (term->scroll_offset || term->scroll_frac) {
+        term->new_lines++;
+        if (term->scroll_offset > -term->scrollback_len) term->scroll_offset--;
+        else term->scroll_frac = 0;
+    }
+    if (full && term->sel_start_row != -1) {
+        /* Lines are numbered from the oldest, which was dropped */
+        if (--term->sel_start_row < 0 || --term->sel_end_row < 0) term->sel_start_row = term->sel_end_row = -1;
+    }
+}
+
+/* Drop a reference to an image, freeing it with its last user */
+static void image_unref(Image *img) {
+    if (--img->refs > 0) return;
+    image_bytes -= (size_t)img->width * img->height * 4;
+    if (img->picture) XRenderFreePicture(xw.dpy, img->picture);
+    if (img->pixmap) XFreePixmap(xw.dpy, img->pixmap);
+    free(img->pixels);
+    free(img);
+}
+
+/* Screen row of a tile in its own buffer, negative in the scrollback */
+static long long tile_row(Term *term, ImageTile *t) {
+    return t->line - (t->alt ? term->alt_lines_scrolled : term->lines_scrolled);
+}
+
+/* Remove the tiles for which drop(tile, arg) is true */
+static void image_remove(Term *term, int (*drop)(Term *, ImageTile *, const void *), const void *arg) {
+    int n = 0;
+    for (int i = 0; i < term->ntiles; i++) {
+        if (drop(term, &term->tiles[i], arg)) image_unref(term->tiles[i].img);
+        else term->tiles[n++] = term->tiles[i];
+    }
+    term->ntiles = n;
+}
+
+/* Tiles that scrolled off the alternate screen or out of the scrollback */
+static int tile_evicted(Term *term, ImageTile *t, const void *arg) {
+    return tile_row(term, t) < (t->alt ? 0 : -term->scrollback_len);
+}
+
+/* Give the scrollback ring room for size lines, keeping the newest */
+static void term_scrollback_resize(Term *term, int size) {
+    int len = MIN(term->scrollback_len, size);
+    char (*data)[MAX_COLS] = size ? xmalloc(size * sizeof(*data)) : NULL;
+    int (*fg)[MAX_COLS] = size ? xmalloc(size * sizeof(*fg)) : NULL;
+    int (*bg)[MAX_COLS] = size ? xmalloc(size * sizeof(*bg)) : NULL;
+
+    for (int i = 0; i < len; i++) {
+        int src = scrollback_row(term, term->scrollback_len - len + i);
+        memcpy(data[i], term->scrollback[src], sizeof(*data));
+        memcpy(fg[i], term->scrollback_fg[src], sizeof(*fg));
+        memcpy(bg[i], term->scrollback_bg[src], sizeof(*bg));
+    }
+    free(term->scrollback);
+    free(term->scrollback_fg);
+    free(term->scrollback_bg);
+    term->scrollback = data;
+    term->scrollback_fg = fg;
+    term->scrollback_bg = bg;
+    term->scrollback_size = size;
+    term->scrollback_pos = size ? len % size : 0;
+    if (len < term->scrollback_len) {
+        /* Lines are numbered from the oldest, which was dropped */
+        term->scrollback_len = len;
+        term->scroll_offset = MAX(term->scroll_offset, -len);
+        if (term->scroll_offset == -len) term->scroll_frac = 0;
+        if (!term->scroll_offset && !term->scroll_frac) term->new_lines = 0;
+        term->sel_start_row = term->sel_end_row = -1;
+        image_remove(term, tile_evicted, NULL);
+    }
+}
+
+/* Tiles on the visible part of the current buffer */
+static int tile_on_screen(Term *term, ImageTile *t, const void *arg) {
+    return t->alt == term->use_alt_buffer && tile_row(term, t) >= 0;
+}
+
+static int tile_on_alt(Term *term, ImageTile *t, const void *arg) {
+    return t->alt;
+}
+
+static int tile_of(Term *term, ImageTile *t, const void *img) {
+    return t->img == img;
+}
+
+/* Free image tiles that scrolled away for good */
+static void image_prune(Term *term) {
+    image_remove(term, tile_evicted, NULL);
+}
+
+/* Remove an image from the kitty store, if it is there */
+static void image_unstore(Term *term, Image *img) {
+    for (int i = 0; i < term->kitty_nstored; i++) {
+        if (term->kitty_store[i] == img) {
+            term->kitty_store[i] = term->kitty_store[--term->kitty_nstored];
+            image_unref(img);
+            return;
+        }
+    }
+}
+
+/* Least recently used image of a terminal, stored or displayed */
+static Image *image_lru(Term *term) {
+    Image *lru = NULL;
+
+    for (int i = 0; i < term->kitty_nstored; i++) {
+        if (!lru || term->kitty_store[i]->used < lru->used) lru = term->kitty_store[i];
+    }
+    for (int i = 0; i < term->ntiles; i++) {
+        if (!lru || term->tiles[i].img->used < lru->used) lru = term->tiles[i].img;
+    }
+    return lru;
+}
+
+/* Evict the least recently used image of any terminal. The one being
+ * written to is looked at too, as it may not be in a tab yet. */
+static int image_evict(Term *term) {
+    Term *owner = term;
+    Image *lru = image_lru(term);
+
+    for (int i = 0; i < ntabs; i++) {
+        for (int p = 0; p < tabs[i].npanes; p++) {
+            Term *t = tabs[i].panes[p];
+            Image *img = t != term ? image_lru(t) : NULL;
+            if (img && (!lru || img->used < lru->used)) {
+                lru = img;
+                owner = t;
+            }
+        }
+    }
+    if (!lru) return 0;
+    lru->refs++;
+    image_remove(owner, tile_of, lru);
+    image_unstore(owner, lru);
+    image_unref(lru);
+    if (owner != term && tabs_visible(owner)) dirty = 1;
+    return 1;
+}
+
+/* Allocate an unreferenced w x h image, evicting older images to keep
+ * all terminals within IMAGE_CACHE_SIZE */
+static Image *image_new(Term *term, int w, int h) {
+    size_t bytes = (size_t)w * h * 4;
+    while (image_bytes + bytes > IMAGE_CACHE_SIZE && image_evict(term))
+        ;
+    Image *img = xmalloc(sizeof(Image));
+    memset(img, 0, sizeof(Image));
+    img->width = w;
+    img->height = h;
+    img->pixels = xmalloc(bytes);
+    img->used = ++image_tick;
+    image_bytes += bytes;
+    return img;
+}
+
+/* Anchor the w x h region at x, y of an image at the cursor, one tile
+ * per text row it covers. Tiles carry absolute line numbers, so they
+ * scroll with the text without being touched. */
+static void image_place(Term *term, Image *img, int x, int y, int w, int h, unsigned int pid, int cursor) {
+    int *row_ptr = term->use_alt_buffer ? &term->alt_row : &term->row;
+    int *col_ptr = term->use_alt_buffer ? &term->alt_col : &term->col;
+    int row = *row_ptr;
+    int rows = (h + term->cell_h - 1) / term->cell_h;
+
+    img->refs++;
+    img->used = ++image_tick;
+    for (int r = 0; r < rows; r++) {
+        if (cursor == IMG_CURSOR_STAY && row + r >= term->rows) break;
+        if (term->ntiles == term->tiles_cap) {
+            term->tiles_cap = term->tiles_cap ? term->tiles_cap * 2 : 16;
+            term->tiles = xrealloc(term->tiles, term->tiles_cap * sizeof(ImageTile));
         }
-        term.scrollback_pos = SCROLLBACK_SIZE - 1;
+        ImageTile *t = &term->tiles[term->ntiles++];
+        t->img = img;
+        t->pid = pid;
+        t->alt = term->use_alt_buffer;
+        t->line = (t->alt ? term->alt_lines_scrolled : term->lines_scrolled) + *row_ptr +
+                  (cursor == IMG_CURSOR_STAY ? r : 0);
+        t->col = *col_ptr;
+        t->src_x = x;
+        t->src_y = y + r * term->cell_h;
+        t->src_w = w;
+        t->src_h = MIN(term->cell_h, h - r * term->cell_h);
+        img->refs++;
+
+        if (cursor == IMG_CURSOR_STAY || (cursor == IMG_CURSOR_AFTER && r == rows - 1)) continue;
+        (*row_ptr)++;
+        if (*row_ptr > term->scroll_bottom) {
+            term_scroll_up(term);
+            *row_ptr = term->scroll_bottom;
+        }
+    }
+    if (cursor == IMG_CURSOR_AFTER) {
+        *col_ptr = MIN(*col_ptr + (w + term->cell_w - 1) / term->cell_w, term->cols - 1);
     }
-    memcpy(term.scrollback[term.scrollback_pos], term.data[r], MAX_COLS);
-    memcpy(term.scrollback_fg[term.scrollback_pos], term.fg[r], MAX_COLS * sizeof(int));
-    memcpy(term.scrollback_bg[term.scrollback_pos], term.bg[r], MAX_COLS * sizeof(int));
-    term.scrollback_pos = (term.scrollback_pos + 1) % SCROLLBACK_SIZE;
+    image_unref(img);
 }
 
 /* Scroll the terminal buffer up */
-static void term_scroll_up(void) {
-    if (term.use_alt_buffer) {
-        for (int r = term.scroll_top; r < term.scroll_bottom; r++) {
-            memcpy(term.alt_data[r], term.alt_data[r + 1], MAX_COLS);
-            memcpy(term.alt_fg[r], term.alt_fg[r + 1], MAX_COLS * sizeof(int));
-            memcpy(term.alt_bg[r], term.alt_bg[r + 1], MAX_COLS * sizeof(int));
-        }
-        term_clear_line(term.scroll_bottom, term.alt_data, term.alt_fg, term.alt_bg);
+static void term_scroll_up(Term *term) {
+    if (term->use_alt_buffer) {
+        term->alt_lines_scrolled++;
+        for (int r = term->scroll_top; r < term->scroll_bottom; r++) {
+            memcpy(term->alt_data[r], term->alt_data[r + 1], MAX_COLS);
+            memcpy(term->alt_fg[r], term->alt_fg[r + 1], MAX_COLS * sizeof(int));
+            memcpy(term->alt_bg[r], term->alt_bg[r + 1], MAX_COLS * sizeof(int));
+        }
+        term_clear_line(term->scroll_bottom, term->alt_data, term->alt_fg, term->alt_bg);
+    } else {
+        term_add_scrollback(term, term->scroll_top);
+        term->lines_scrolled++;
+        for (int r = term->scroll_top; r < term->scroll_bottom; r++) {
+            memcpy(term->data[r], term->data[r + 1], MAX_COLS);
+            memcpy(term->fg[r], term->fg[r + 1], MAX_COLS * sizeof(int));
+            memcpy(term->bg[r], term->bg[r + 1], MAX_COLS * sizeof(int));
+        }
+        term_clear_line(term->scroll_bottom, term->data, term->fg, term->bg);
+    }
+    if (term->ntiles) image_prune(term);
+}
+
+/* Kitty keyboard flags in effect on the current screen */
+static int kitty_flags(Term *term) {
+    int s = term->use_alt_buffer;
+    return term->kitty_depth[s] ? term->kitty_keys[s][term->kitty_depth[s] - 1] : 0;
+}
+
+/* Handle the kitty keyboard protocol's CSI ? u, CSI > u, CSI < u and
+ * CSI = u. Each screen has its own stack of enhancement flags. */
+static void kitty_csi(Term *term) {
+    int s = term->use_alt_buffer;
+    int *stack = term->kitty_keys[s];
+    int arg = atoi(term->escape_buf + 3);
+
+    switch (term->escape_buf[2]) {
+    case '?': /* Query */
+        {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "\033[?%du", kitty_flags(term));
+            ttywrite(term, buf, len);
+        }
+        break;
+    case '>': /* Push, evicting the oldest entry when full */
+        if (term->kitty_depth[s] == KITTY_STACK_SIZE) {
+            memmove(stack, stack + 1, (KITTY_STACK_SIZE - 1) * sizeof(int));
+            term->kitty_depth[s]--;
+        }
+        stack[term->kitty_depth[s]++] = arg & KITTY_ALL_FLAGS;
+        break;
+    case '<': /* Pop */
+        term->kitty_depth[s] = MAX(term->kitty_depth[s] - MAX(arg, 1), 0);
+        break;
+    case '=': /* Modify the current entry: mode 1 set, 2 or, 3 and-not */
+        {
+            char *mode = strchr(term->escape_buf, ';');
+            int how = mode ? atoi(mode + 1) : 1;
+            if (!term->kitty_depth[s]) stack[term->kitty_depth[s]++] = 0;
+            int *flags = &stack[term->kitty_depth[s] - 1];
+            if (how == 2) *flags |= arg;
+            else if (how == 3) *flags &= ~arg;
+            else *flags = arg;
+            *flags &= KITTY_ALL_FLAGS;
+        }
+        break;
+    }
+}
+
+/* Convert a sixel HLS color (hue 0 is blue) to RGB, all in percent */
+static uint32_t sixel_hls(int h, int l, int s) {
+    double hue = ((h + 240) % 360) / 60.0;
+    double c = (1 - fabs(2 * l / 100.0 - 1)) * s / 100.0;
+    double x = c * (1 - fabs(fmod(hue, 2) - 1));
+    double m = l / 100.0 - c / 2;
+    double rgb[6][3] = {{c, x, 0}, {x, c, 0}, {0, c, x}, {0, x, c}, {x, 0, c}, {c, 0, x}};
+    double *v = rgb[(int)hue % 6];
+    return 0xff000000 | (uint32_t)((v[0] + m) * 255) << 16 |
+           (uint32_t)((v[1] + m) * 255) << 8 | (uint32_t)((v[2] + m) * 255);
+}
+
+/* Start decoding a sixel image, P2 = 1 keeps unset pixels transparent */
+static void sixel_start(Term *term) {
+    /* VT340 default palette, in percent */
+    static const unsigned char vt340[16][3] = {
+        {0, 0, 0}, {20, 20, 80}, {80, 13, 13}, {20, 80, 20},
+        {80, 20, 80}, {20, 80, 80}, {80, 80, 20}, {53, 53, 53},
+        {26, 26, 26}, {33, 33, 60}, {60, 26, 26}, {33, 60, 33},
+        {60, 33, 60}, {33, 60, 60}, {60, 60, 33}, {80, 80, 80},
+    };
+    int p2 = 0;
+
+    sscanf(term->escape_buf + 2, "%*d;%d", &p2);
+    free(term->sixel.pixels);
+    memset(&term->sixel, 0, sizeof(term->sixel));
+    term->sixel.transparent = p2 == 1;
+    for (int i = 0; i < 16; i++) {
+        term->sixel.palette[i] = 0xff000000 | (vt340[i][0] * 255 / 100) << 16 |
+                           (vt340[i][1] * 255 / 100) << 8 | (vt340[i][2] * 255 / 100);
+    }
+    for (int i = 16; i < SIXEL_PALETTE_SIZE; i++) term->sixel.palette[i] = 0xff000000;
+}
+
+/* Grow the canvas to at least w x h pixels; 0 if over the size limit */
+static int sixel_reserve(Term *term, int w, int h) {
+    if (w <= term->sixel.cap_w && h <= term->sixel.cap_h) return 1;
+    if (w > IMAGE_MAX_SIZE || h > IMAGE_MAX_SIZE) return 0;
+    int cap_w = MIN(MAX(w, term->sixel.cap_w * 2), IMAGE_MAX_SIZE);
+    int cap_h = MIN(MAX(h, term->sixel.cap_h * 2), IMAGE_MAX_SIZE);
+    uint32_t fill = term->sixel.transparent ? 0 : term->sixel.palette[0];
+    uint32_t *pixels = xmalloc((size_t)cap_w * cap_h * 4);
+    for (size_t i = 0; i < (size_t)cap_w * cap_h; i++) pixels[i] = fill;
+    for (int y = 0; y < term->sixel.cap_h; y++) {
+        memcpy(pixels + (size_t)y * cap_w, term->sixel.pixels + (size_t)y * term->sixel.cap_w, term->sixel.cap_w * 4);
+    }
+    free(term->sixel.pixels);
+    term->sixel.pixels = pixels;
+    term->sixel.cap_w = cap_w;
+    term->sixel.cap_h = cap_h;
+    return 1;
+}
+
+/* Apply a completed #, ! or " command */
+static void sixel_command(Term *term) {
+    int *p = term->sixel.params;
+
+    switch (term->sixel.cmd) {
+    case '#': /* Select color, or define and select it */
+        term->sixel.color = MIN(MAX(p[0], 0), SIXEL_PALETTE_SIZE - 1);
+        if (term->sixel.nparams >= 5) {
+            if (p[1] == 1) {
+                term->sixel.palette[term->sixel.color] = sixel_hls(p[2], p[3], p[4]);
+            } else if (p[1] == 2) {
+                term->sixel.palette[term->sixel.color] = 0xff000000 | (MIN(p[2], 100) * 255 / 100) << 16 |
+                                             (MIN(p[3], 100) * 255 / 100) << 8 | (MIN(p[4], 100) * 255 / 100);
+            }
+        }
+        break;
+    case '!': /* Repeat the next sixel */
+        term->sixel.repeat = MAX(p[0], 1);
+        break;
+    case '"': /* Raster attributes: Pan;Pad;Ph;Pv */
+        if (term->sixel.nparams >= 4 && p[2] > 0 && p[3] > 0 && sixel_reserve(term, p[2], p[3])) {
+            term->sixel.width = MAX(term->sixel.width, p[2]);
+            term->sixel.height = MAX(term->sixel.height, p[3]);
+        }
+        break;
+    }
+    term->sixel.cmd = 0;
+}
+
+/* Decode one byte of sixel data straight into the canvas */
+static void sixel_putc(Term *term, char c) {
+    if (term->sixel.cmd) {
+        if (c >= '0' && c <= '9') {
+            int *p = &term->sixel.params[term->sixel.nparams ? term->sixel.nparams - 1 : 0];
+            if (!term->sixel.nparams) term->sixel.nparams = 1;
+            *p = MIN(*p * 10 + (c - '0'), 0xffff);
+            return;
+        }
+        if (c == ';') {
+            if (!term->sixel.nparams) term->sixel.nparams = 1;
+            if (term->sixel.nparams < SIXEL_MAX_PARAMS) term->sixel.params[term->sixel.nparams++] = 0;
+            return;
+        }
+        sixel_command(term);
+    }
+
+    if (c >= '?' && c <= '~') {
+        int bits = c - '?';
+        int n = term->sixel.repeat ? term->sixel.repeat : 1;
+        term->sixel.repeat = 0;
+        if (!sixel_reserve(term, term->sixel.x + n, term->sixel.y + 6)) return;
+        uint32_t color = term->sixel.palette[term->sixel.color];
+        for (int b = 0; b < 6; b++) {
+            if (!(bits & (1 << b))) continue;
+            uint32_t *px = term->sixel.pixels + (size_t)(term->sixel.y + b) * term->sixel.cap_w + term->sixel.x;
+            for (int i = 0; i < n; i++) px[i] = color;
+            term->sixel.height = MAX(term->sixel.height, term->sixel.y + b + 1);
+        }
+        term->sixel.x += n;
+        term->sixel.width = MAX(term->sixel.width, term->sixel.x);
+    } else if (c == '$') { /* Carriage return */
+        term->sixel.x = 0;
+    } else if (c == '-') { /* Next band of six rows */
+        term->sixel.x = 0;
+        term->sixel.y += 6;
+    } else if (c == '#' || c == '!' || c == '"') {
+        term->sixel.cmd = c;
+        term->sixel.nparams = 0;
+        memset(term->sixel.params, 0, sizeof(term->sixel.params));
+    }
+}
+
+/* The string terminator arrived: turn the canvas into an image */
+static void sixel_finish(Term *term) {
+    if (term->sixel.cmd) sixel_command(term);
+    if (!term->sixel.pixels || !term->sixel.width || !term->sixel.height) {
+        free(term->sixel.pixels);
+        term->sixel.pixels = NULL;
+        return;
+    }
+    Image *img = image_new(term, term->sixel.width, term->sixel.height);
+    for (int y = 0; y < img->height; y++) {
+        memcpy(img->pixels + (size_t)y * img->width, term->sixel.pixels + (size_t)y * term->sixel.cap_w, img->width * 4);
+    }
+    free(term->sixel.pixels);
+    term->sixel.pixels = NULL;
+    image_place(term, img, 0, 0, img->width, img->height, 0, IMG_CURSOR_BELOW);
+}
+
+/* Reply to a kitty graphics command; quiet 1 drops OK, quiet 2 drops all */
+static void kitty_reply(Term *term, const char *msg) {
+    char buf[128];
+    int n;
+
+    if (!term->kgr.id || term->kgr.quiet >= 2 || (term->kgr.quiet == 1 && strcmp(msg, "OK") == 0)) return;
+    if (term->kgr.pid) n = snprintf(buf, sizeof(buf), "\033_Gi=%u,p=%u;%s\033\\", term->kgr.id, term->kgr.pid, msg);
+    else n = snprintf(buf, sizeof(buf), "\033_Gi=%u;%s\033\\", term->kgr.id, msg);
+    ttywrite(term, buf, MIN(n, (int)sizeof(buf) - 1));
+}
+
+/* Value of a base64 digit, -1 for anything else */
+static int base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    return c == '+' ? 62 : c == '/' ? 63 : -1;
+}
+
+/* Decode a base64 chunk onto the command's payload */
+static void kitty_base64(Term *term, const char *s) {
+    unsigned int acc = 0;
+    int bits = 0;
+
+    for (; *s; s++) {
+        int v = base64_value(*s);
+        if (v < 0) continue; /* Padding */
+        acc = acc << 6 | v;
+        bits += 6;
+        if (bits < 8) continue;
+        bits -= 8;
+        if (term->kgr.len == term->kgr.cap) {
+            if (term->kgr.cap >= (size_t)IMAGE_MAX_SIZE * IMAGE_MAX_SIZE * 4) {
+                term->kgr.error = "EFBIG:image data too large";
+                return;
+            }
+            term->kgr.cap = term->kgr.cap ? term->kgr.cap * 2 : 4096;
+            term->kgr.data = xrealloc(term->kgr.data, term->kgr.cap);
+        }
+        term->kgr.data[term->kgr.len++] = acc >> bits;
+    }
+}
+
+#ifdef PNG
+/* Inflate zlib data (o=z) into a new buffer */
+static unsigned char *kitty_inflate(const unsigned char *p, size_t n, size_t *len) {
+    z_stream zs = {0};
+    size_t cap = n * 4 + 4096;
+    unsigned char *out;
+    int ret = Z_DATA_ERROR;
+
+    if (inflateInit(&zs) != Z_OK) return NULL;
+    out = xmalloc(cap);
+    zs.next_in = (unsigned char *)p;
+    zs.avail_in = n;
+    do {
+        if (zs.total_out == cap) {
+            if (cap >= (size_t)IMAGE_MAX_SIZE * IMAGE_MAX_SIZE * 4) break;
+            cap *= 2;
+            out = xrealloc(out, cap);
+        }
+        zs.next_out = out + zs.total_out;
+        zs.avail_out = cap - zs.total_out;
+        ret = inflate(&zs, Z_NO_FLUSH);
+    } while (ret == Z_OK);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    *len = zs.total_out;
+    return out;
+}
+#endif
+
+/* Decode RGB, RGBA or PNG data into a new image */
+static Image *kitty_decode(Term *term, const unsigned char *p, size_t n) {
+    unsigned char *inflated = NULL, *rgba = NULL;
+    int w = term->kgr.width, h = term->kgr.height, bpp = term->kgr.format == 24 ? 3 : 4;
+    Image *img = NULL;
+
+#ifdef PNG
+    if (term->kgr.compression == 'z') {
+        if (!(inflated = kitty_inflate(p, n, &n))) {
+            term->kgr.error = "EINVAL:bad compressed data";
+            return NULL;
+        }
+        p = inflated;
+    }
+    if (term->kgr.format == 100) {
+        png_image png = {.version = PNG_IMAGE_VERSION};
+        if (png_image_begin_read_from_memory(&png, p, n)) {
+            png.format = PNG_FORMAT_RGBA;
+            w = png.width;
+            h = png.height;
+            if (w > IMAGE_MAX_SIZE || h > IMAGE_MAX_SIZE) {
+                png_image_free(&png);
+            } else {
+                rgba = xmalloc(PNG_IMAGE_SIZE(png));
+                if (!png_image_finish_read(&png, NULL, rgba, 0, NULL)) {
+                    free(rgba);
+                    rgba = NULL;
+                }
+            }
+        }
+        if (!rgba) {
+            term->kgr.error = "EBADPNG:cannot decode PNG";
+            goto done;
+        }
+        p = rgba;
+        n = (size_t)w * h * 4;
+    }
+#else
+    if (term->kgr.compression || term->kgr.format == 100) {
+        term->kgr.error = "ENOTSUP:PNG and compression not built in";
+        return NULL;
+    }
+#endif
+    if (term->kgr.format != 24 && term->kgr.format != 32 && term->kgr.format != 100) {
+        term->kgr.error = "EINVAL:unknown format";
+    } else if (w <= 0 || h <= 0 || w > IMAGE_MAX_SIZE || h > IMAGE_MAX_SIZE) {
+        term->kgr.error = "EINVAL:bad image size";
+    } else if (n < (size_t)w * h * bpp) {
+        term->kgr.error = "ENODATA:insufficient image data";
+    } else {
+        img = image_new(term, w, h);
+        for (size_t i = 0; i < (size_t)w * h; i++, p += bpp) {
+            unsigned int a = bpp == 4 ? p[3] : 255;
+            img->pixels[i] = a << 24 | (p[0] * a / 255) << 16 | (p[1] * a / 255) << 8 | p[2] * a / 255;
+        }
+    }
+#ifdef PNG
+done:
+#endif
+    free(inflated);
+    free(rgba);
+    return img;
+}
+
+/* Map the file (t=f, t=t) or shared memory object (t=s) named by the
+ * payload. Temporary files and shared memory are removed once mapped,
+ * so the client can hand over large images without base64 on the PTY. */
+static void *kitty_map(Term *term, size_t *maplen) {
+    char name[PATH_MAX];
+    struct stat st;
+    void *map = MAP_FAILED;
+    int fd;
+
+    if (term->kgr.len == 0 || term->kgr.len >= sizeof(name)) return NULL;
+    memcpy(name, term->kgr.data, term->kgr.len);
+    name[term->kgr.len] = '\0';
+    if (term->kgr.medium == 's') {
+        fd = shm_open(name, O_RDONLY, 0);
+    } else if (term->kgr.medium == 't' && !strstr(name, "tty-graphics-protocol")) {
+        return NULL; /* Only delete files meant for us */
     } else {
-        term_add_scrollback(term.scroll_top);
-        for (int r = term.scroll_top; r < term.scroll_bottom; r++) {
-            memcpy(term.data[r], term.data[r + 1], MAX_COLS);
-            memcpy(term.fg[r], term.fg[r + 1], MAX_COLS * sizeof(int));
-            memcpy(term.bg[r], term.bg[r + 1], MAX_COLS * sizeof(int));
+        /* Like kitty, nothing under /proc, /sys or /dev but /dev/shm.
+         * A FIFO or a device would block the open or the read, so
+         * open does not wait and anything but a regular file is
+         * refused below. */
+        char real[PATH_MAX];
+        if (!realpath(name, real) || !strncmp(real, "/proc/", 6) || !strncmp(real, "/sys/", 5) ||
+            (!strncmp(real, "/dev/", 5) && strncmp(real, "/dev/shm/", 9))) {
+            return NULL;
+        }
+        fd = open(real, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOFOLLOW);
+    }
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size > term->kgr.offset) {
+        size_t size = st.st_size - term->kgr.offset;
+        if (term->kgr.size) size = MIN(size, term->kgr.size);
+        *maplen = term->kgr.offset + size;
+        map = mmap(NULL, *maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (term->kgr.medium == 's') shm_unlink(name);
+    else if (term->kgr.medium == 't') unlink(name);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+/* Load the image the command transmitted, directly or by reference */
+static Image *kitty_load(Term *term) {
+    unsigned char *p = term->kgr.data;
+    size_t n = term->kgr.len, maplen = 0;
+    void *map = NULL;
+
+    if (term->kgr.error) return NULL;
+    if (term->kgr.medium != 'd') {
+        if (!(map = kitty_map(term, &maplen))) {
+            term->kgr.error = "EBADF:cannot read image";
+            return NULL;
+        }
+        p = (unsigned char *)map + term->kgr.offset;
+        n = maplen - term->kgr.offset;
+    }
+    Image *img = kitty_decode(term, p, n);
+    if (map) munmap(map, maplen);
+    return img;
+}
+
+static Image *kitty_find(Term *term, unsigned int id) {
+    for (int i = 0; i < term->kitty_nstored; i++) {
+        if (term->kitty_store[i]->id == id) return term->kitty_store[i];
+    }
+    return NULL;
+}
+
+/* Keep an image for later placement, replacing one with the same id */
+static void kitty_keep(Term *term, Image *img) {
+    Image *old = kitty_find(term, img->id);
+    if (old) image_unstore(term, old);
+    if (term->kitty_nstored == term->kitty_store_cap) {
+        term->kitty_store_cap = term->kitty_store_cap ? term->kitty_store_cap * 2 : 16;
+        term->kitty_store = xrealloc(term->kitty_store, term->kitty_store_cap * sizeof(Image *));
+    }
+    term->kitty_store[term->kitty_nstored++] = img;
+    img->refs++;
+}
+
+/* Tiles of the image (and placement, when given) the command names */
+static int tile_kitty_id(Term *term, ImageTile *t, const void *arg) {
+    const KittyCmd *k = arg;
+    return t->img->id == k->id && (!k->pid || t->pid == k->pid);
+}
+
+/* Tiles of the same placement as another tile */
+static int tile_placement(Term *term, ImageTile *t, const void *arg) {
+    const ImageTile *hit = arg;
+    return t->img == hit->img && t->pid == hit->pid && t->col == hit->col && t->alt == hit->alt;
+}
+
+/* Display an image at the cursor, replacing a placement with its ids */
+static void kitty_put(Term *term, Image *img) {
+    int x = MIN(term->kgr.x, img->width), y = MIN(term->kgr.y, img->height);
+    int w = term->kgr.w ? MIN(term->kgr.w, img->width - x) : img->width - x;
+    int h = term->kgr.h ? MIN(term->kgr.h, img->height - y) : img->height - y;
+
+    if (w <= 0 || h <= 0) return;
+    if (term->kgr.id && term->kgr.pid) image_remove(term, tile_kitty_id, &term->kgr);
+    image_place(term, img, x, y, w, h, term->kgr.pid, term->kgr.cursor ? IMG_CURSOR_STAY : IMG_CURSOR_AFTER);
+}
+
+/* Delete placements: all visible (a), by id (i) or under the cursor
+ * (c). Upper case also frees image data no placement uses any more. */
+static void kitty_delete(Term *term) {
+    ImageTile hit = {0};
+    int row = term->use_alt_buffer ? term->alt_row : term->row;
+    int col = term->use_alt_buffer ? term->alt_col : term->col;
+
+    switch (term->kgr.del) {
+    case 'a':
+    case 'A':
+        image_remove(term, tile_on_screen, NULL);
+        break;
+    case 'i':
+    case 'I':
+        image_remove(term, tile_kitty_id, &term->kgr);
+        break;
+    case 'c':
+    case 'C':
+        for (int i = 0; i < term->ntiles; i++) {
+            ImageTile *t = &term->tiles[i];
+            if (tile_on_screen(term, t, NULL) && tile_row(term, t) == row && col >= t->col &&
+                col < t->col + (t->src_w + term->cell_w - 1) / term->cell_w) {
+                hit = *t;
+                image_remove(term, tile_placement, &hit);
+                break;
+            }
+        }
+        break;
+    }
+    if (term->kgr.del < 'A' || term->kgr.del > 'Z') return;
+    for (int i = term->kitty_nstored - 1; i >= 0; i--) {
+        Image *img = term->kitty_store[i];
+        if (img->refs == 1 && (term->kgr.del == 'A' || (term->kgr.del == 'I' && img->id == term->kgr.id) || img == hit.img)) {
+            image_unstore(term, img);
+        }
+    }
+}
+
+/* Carry out a complete kitty graphics command */
+static void kitty_run(Term *term) {
+    Image *img;
+
+    switch (term->kgr.action) {
+    case 'd':
+        kitty_delete(term);
+        return;
+    case 'p':
+        if (!(img = kitty_find(term, term->kgr.id))) {
+            kitty_reply(term, "ENOENT:image not found");
+            return;
+        }
+        kitty_put(term, img);
+        kitty_reply(term, "OK");
+        return;
+    case 't':
+    case 'T':
+    case 'q':
+        break;
+    default:
+        return;
+    }
+
+    if (!(img = kitty_load(term))) {
+        kitty_reply(term, term->kgr.error ? term->kgr.error : "EINVAL:bad image");
+        return;
+    }
+    img->id = term->kgr.id;
+    img->refs++;
+    if (term->kgr.action != 'q') {
+        if (term->kgr.id) kitty_keep(term, img);
+        if (term->kgr.action == 'T') kitty_put(term, img);
+    }
+    image_unref(img);
+    kitty_reply(term, "OK");
+}
+
+/* Handle a kitty graphics escape, ESC _ G keys ; payload ESC \.
+ * Large transfers arrive in chunks; the keys of the first chunk apply
+ * until one with m=0 completes the command. */
+static void kitty_graphics(Term *term, char *s) {
+    char *payload = strchr(s, ';');
+
+    if (!term->kgr.more) {
+        free(term->kgr.data);
+        memset(&term->kgr, 0, sizeof(term->kgr));
+        term->kgr.action = 't';
+        term->kgr.medium = 'd';
+        term->kgr.format = 32;
+        term->kgr.del = 'a';
+    }
+    term->kgr.more = 0;
+
+    /* Comma separated key=value pairs */
+    for (char *p = s; *p && *p != ';';) {
+        char key = *p++;
+        if (*p != '=') break;
+        char *v = ++p;
+        unsigned long num = strtoul(v, &p, 10);
+        switch (key) {
+        case 'a': term->kgr.action = *v; break;
+        case 't': term->kgr.medium = *v; break;
+        case 'd': term->kgr.del = *v; break;
+        case 'o': term->kgr.compression = *v; break;
+        case 'f': term->kgr.format = num; break;
+        case 'i': term->kgr.id = num; break;
+        case 'p': term->kgr.pid = num; break;
+        case 'q': term->kgr.quiet = num; break;
+        case 'm': term->kgr.more = num; break;
+        case 'C': term->kgr.cursor = num; break;
+        case 's': term->kgr.width = MIN(num, INT_MAX); break;
+        case 'v': term->kgr.height = MIN(num, INT_MAX); break;
+        case 'x': term->kgr.x = MIN(num, INT_MAX); break;
+        case 'y': term->kgr.y = MIN(num, INT_MAX); break;
+        case 'w': term->kgr.w = MIN(num, INT_MAX); break;
+        case 'h': term->kgr.h = MIN(num, INT_MAX); break;
+        case 'S': term->kgr.size = num; break;
+        case 'O': term->kgr.offset = num; break;
+        }
+        while (*p && *p != ',' && *p != ';') p++;
+        if (*p == ',') p++;
+    }
+    if (payload && !term->kgr.error) kitty_base64(term, payload + 1);
+    if (term->kgr.more) return;
+
+    kitty_run(term);
+    free(term->kgr.data);
+    term->kgr.data = NULL;
+}
+
+/* Whether escape_buf holds a complete escape sequence */
+static int escape_complete(Term *term) {
+    char c = term->escape_buf[term->escape_len - 1];
+
+    switch (term->escape_buf[1]) {
+    case '[': /* CSI and DCS: parameters up to a final byte */
+    case 'P':
+        return term->escape_len > 2 && c >= 0x40 && c <= 0x7e;
+    case ']': /* OSC: up to BEL or ST */
+        return c == '\a' || (c == '\\' && term->escape_buf[term->escape_len - 2] == '\033');
+    case '(': case ')': case '*': case '+': case '#': case '%':
+        return term->escape_len == 3; /* Intermediate and final byte */
+    default:
+        return 1; /* Single final byte, e.g. ESC 7 */
+    }
+}
+
+/* Print the run of printable characters s starts with, translated
+ * through cs, a line at a time. With line wrapping off, characters past
+ * the margin overwrite the last column, as in xterm. Returns the length
+ * of the run. */
+static size_t term_print(Term *term, const unsigned char *cs, const char *s, size_t n) {
+    char (*data)[MAX_COLS] = term->use_alt_buffer ? term->alt_data : term->data;
+    int (*fg)[MAX_COLS] = term->use_alt_buffer ? term->alt_fg : term->fg;
+    int (*bg)[MAX_COLS] = term->use_alt_buffer ? term->alt_bg : term->bg;
+    int *row_ptr = term->use_alt_buffer ? &term->alt_row : &term->row;
+    int *col_ptr = term->use_alt_buffer ? &term->alt_col : &term->col;
+    size_t len = 0;
+
+    while (len < n && s[len] >= 32 && s[len] <= 126) len++;
+    for (size_t i = 0; i < len;) {
+        int row = *row_ptr, col = *col_ptr;
+        if (row >= term->rows) break;
+        if (col >= term->cols) {
+            if (term->wrap) break;
+            i = len - 1; /* Only the last one stays */
+            col = term->cols - 1;
+        }
+        int m = MIN(len - i, (size_t)(term->cols - col));
+        for (int j = 0; j < m; j++) {
+            data[row][col + j] = cs[(unsigned char)s[i + j]];
+            fg[row][col + j] = term->current_fg;
+            bg[row][col + j] = term->current_bg;
+        }
+        i += m;
+        *col_ptr = col + m;
+        if (*col_ptr >= term->cols && term->wrap) {
+            (*row_ptr)++;
+            *col_ptr = 0;
+            if (*row_ptr > term->scroll_bottom) {
+                term_scroll_up(term);
+                *row_ptr = term->scroll_bottom;
+            }
         }
-        term_clear_line(term.scroll_bottom, term.data, term.fg, term.bg);
     }
+    return len;
 }
 
 /* Add a character to the terminal buffer */
-static void term_putc(char c) {
-    /* Debug: Print each character being processed */
-    fprintf(stderr, "term_putc: %c (row=%d, col=%d, alt=%d)\n", c, 
-            term.use_alt_buffer ? term.alt_row : term.row, 
-            term.use_alt_buffer ? term.alt_col : term.col, 
-            term.use_alt_buffer);
-
-    if (in_escape) {
-        escape_buf[escape_len++] = c;
-        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '?' || c == '@') {
-            escape_buf[escape_len] = '\0';
-            in_escape = 0;
+static void term_putc(Term *term, char c) {
+    if (term->in_str) {
+        /* Control strings are consumed as they stream in */
+        if (c == 0x18 || c == 0x1a) { /* CAN, SUB: abort */
+            if (term->in_str == STR_SIXEL) {
+                free(term->sixel.pixels);
+                term->sixel.pixels = NULL;
+            }
+            term->in_str = STR_NONE;
+            return;
+        }
+        if (c != '\033') {
+            if (term->in_str == STR_SIXEL) {
+                sixel_putc(term, c);
+            } else if (term->in_str == STR_APC) {
+                if (term->apc_len + 1 == KITTY_CHUNK_MAX) {
+                    term->in_str = STR_IGNORE;
+                } else {
+                    if (term->apc_len + 1 >= term->apc_cap) {
+                        term->apc_cap = term->apc_cap ? MIN(term->apc_cap * 2, KITTY_CHUNK_MAX) : 4096;
+                        term->apc_buf = xrealloc(term->apc_buf, term->apc_cap);
+                    }
+                    term->apc_buf[term->apc_len++] = c;
+                }
+            }
+            return;
+        }
+        /* ESC starts the string terminator */
+        if (term->in_str == STR_SIXEL) sixel_finish(term);
+        if (term->in_str == STR_APC && term->apc_len > 0 && term->apc_buf[0] == 'G') {
+            term->apc_buf[term->apc_len] = '\0';
+            kitty_graphics(term, term->apc_buf + 1);
+        }
+        term->in_str = STR_NONE;
+    }
+
+    if (term->in_escape) {
+        if (term->escape_len >= ESCAPE_BUF_SIZE - 1) {
+            /* Not a sequence we could handle; drop it */
+            term->in_escape = 0;
+            term->escape_len = 0;
+            return;
+        }
+        term->escape_buf[term->escape_len++] = c;
+        if (escape_complete(term)) {
+            term->escape_buf[term->escape_len] = '\0';
+            term->in_escape = 0;
             /* Handle ANSI escape sequences */
-            if (strcmp(escape_buf, "[2J") == 0) { /* Clear screen */
-                char (*data)[MAX_COLS] = term.use_alt_buffer ? term.alt_data : term.data;
-                int (*fg)[MAX_COLS] = term.use_alt_buffer ? term.alt_fg : term.fg;
-                int (*bg)[MAX_COLS] = term.use_alt_buffer ? term.alt_bg : term.bg;
-                for (int r = 0; r < xw.row; r++) {
+            if (term->escape_buf[1] == 'P') { /* Device control string, data follows */
+                /* Sixel is P <params> q; DECRQSS ($q) and XTGETTCAP (+q)
+                 * end in q too, with an intermediate byte */
+                if (term->escape_buf[term->escape_len - 1] == 'q' &&
+                    strspn(term->escape_buf + 2, "0123456789;") == (size_t)term->escape_len - 3) {
+                    sixel_start(term);
+                    term->in_str = STR_SIXEL;
+                } else {
+                    term->in_str = STR_IGNORE;
+                }
+            } else if (term->escape_buf[1] == '_') { /* Application program command */
+                term->apc_len = 0;
+                term->in_str = STR_APC;
+            } else if (term->escape_buf[1] == 'X' || term->escape_buf[1] == '^') { /* SOS, PM */
+                term->in_str = STR_IGNORE;
+            } else if (term->escape_len == 3 && strchr("()*+", term->escape_buf[1])) {
+                /* Designate G0-G3: \033(0 is DEC special graphics, \033(B ASCII */
+                term->charsets[strchr("()*+", term->escape_buf[1]) - "()*+"] = charset_find(term->escape_buf[2]);
+            } else if (term->escape_buf[1] == 'n' || term->escape_buf[1] == 'o') { /* LS2, LS3 */
+                term->gl = term->escape_buf[1] == 'n' ? 2 : 3;
+            } else if (term->escape_buf[1] == 'N' || term->escape_buf[1] == 'O') { /* SS2, SS3 */
+                term->single_shift = term->escape_buf[1] == 'N' ? 2 : 3;
+            } else if (strcmp(term->escape_buf + 1, "[2J") == 0) { /* Clear screen */
+                image_remove(term, tile_on_screen, NULL);
+                char (*data)[MAX_COLS] = term->use_alt_buffer ? term->alt_data : term->data;
+                int (*fg)[MAX_COLS] = term->use_alt_buffer ? term->alt_fg : term->fg;
+                int (*bg)[MAX_COLS] = term->use_alt_buffer ? term->alt_bg : term->bg;
+                for (int r = 0; r < term->rows; r++) {
                     term_clear_line(r, data, fg, bg);
                 }
-                if (term.use_alt_buffer) {
-                    term.alt_row = 0;
-                    term.alt_col = 0;
+                if (term->use_alt_buffer) {
+                    term->alt_row = 0;
+                    term->alt_col = 0;
                 } else {
-                    term.row = 0;
-                    term.col = 0;
+                    term->row = 0;
+                    term->col = 0;
                 }
-            } else if (strcmp(escape_buf, "[H") == 0) { /* Move to top-left */
-                if (term.use_alt_buffer) {
-                    term.alt_row = 0;
-                    term.alt_col = 0;
+            } else if (strcmp(term->escape_buf + 1, "[H") == 0) { /* Move to top-left */
+                if (term->use_alt_buffer) {
+                    term->alt_row = 0;
+                    term->alt_col = 0;
                 } else {
-                    term.row = 0;
-                    term.col = 0;
+                    term->row = 0;
+                    term->col = 0;
                 }
-            } else if (strcmp(escape_buf, "[K") == 0) { /* Clear to end of line */
-                term_clear_to_eol();
-            } else if (strcmp(escape_buf, "[J") == 0) { /* Clear below cursor */
-                term_clear_below();
-            } else if (strcmp(escape_buf, "[1J") == 0) { /* Clear above cursor */
-                term_clear_above();
-            } else if (strcmp(escape_buf, "[?7h") == 0) { /* Enable line wrapping */
-                wrap = 1;
-            } else if (strcmp(escape_buf, "[?7l") == 0) { /* Disable line wrapping */
-                wrap = 0;
-            } else if (strcmp(escape_buf, "[?25h") == 0) { /* Show cursor */
+            } else if (strcmp(term->escape_buf + 1, "[K") == 0) { /* Clear to end of line */
+                term_clear_to_eol(term);
+            } else if (strcmp(term->escape_buf + 1, "[J") == 0) { /* Clear below cursor */
+                term_clear_below(term);
+            } else if (strcmp(term->escape_buf + 1, "[1J") == 0) { /* Clear above cursor */
+                term_clear_above(term);
+            } else if (strcmp(term->escape_buf + 1, "[?7h") == 0) { /* Enable line wrapping */
+                term->wrap = 1;
+            } else if (strcmp(term->escape_buf + 1, "[?7l") == 0) { /* Disable line wrapping */
+                term->wrap = 0;
+            } else if (strcmp(term->escape_buf + 1, "[?25h") == 0) { /* Show cursor */
                 /* No-op for now */
-            } else if (strcmp(escape_buf, "[?25l") == 0) { /* Hide cursor */
+            } else if (strcmp(term->escape_buf + 1, "[?25l") == 0) { /* Hide cursor */
                 /* No-op for now */
-            } else if (strcmp(escape_buf, "[?1000h") == 0) { /* Enable mouse reporting (normal tracking) */
-                mouse_enabled = 1;
-                mouse_mode = 1000;
-            } else if (strcmp(escape_buf, "[?1000l") == 0) { /* Disable mouse reporting */
-                mouse_enabled = 0;
-                mouse_mode = 0;
-            } else if (strcmp(escape_buf, "[?1002h") == 0) { /* Enable mouse button press/release */
-                mouse_enabled = 1;
-                mouse_mode = 1002;
-            } else if (strcmp(escape_buf, "[?1002l") == 0) { /* Disable mouse button press/release */
-                mouse_enabled = 0;
-                mouse_mode = 0;
-            } else if (strcmp(escape_buf, "[?1003h") == 0) { /* Enable mouse any event */
-                mouse_enabled = 1;
-                mouse_mode = 1003;
-            } else if (strcmp(escape_buf, "[?1003l") == 0) { /* Disable mouse any event */
-                mouse_enabled = 0;
-                mouse_mode = 0;
-            } else if (strcmp(escape_buf, "[?1049h") == 0) { /* Switch to alternate screen buffer */
-                term.use_alt_buffer = 1;
-                for (int r = 0; r < xw.row; r++) {
-                    term_clear_line(r, term.alt_data, term.alt_fg, term.alt_bg);
+            } else if (strcmp(term->escape_buf + 1, "[?1000h") == 0) { /* Enable mouse reporting (normal tracking) */
+                term->mouse_enabled = 1;
+                term->mouse_mode = 1000;
+            } else if (strcmp(term->escape_buf + 1, "[?1000l") == 0) { /* Disable mouse reporting */
+                term->mouse_enabled = 0;
+                term->mouse_mode = 0;
+            } else if (strcmp(term->escape_buf + 1, "[?1002h") == 0) { /* Enable mouse button press/release */
+                term->mouse_enabled = 1;
+                term->mouse_mode = 1002;
+            } else if (strcmp(term->escape_buf + 1, "[?1002l") == 0) { /* Disable mouse button press/release */
+                term->mouse_enabled = 0;
+                term->mouse_mode = 0;
+            } else if (strcmp(term->escape_buf + 1, "[?1003h") == 0) { /* Enable mouse any event */
+                term->mouse_enabled = 1;
+                term->mouse_mode = 1003;
+            } else if (strcmp(term->escape_buf + 1, "[?1003l") == 0) { /* Disable mouse any event */
+                term->mouse_enabled = 0;
+                term->mouse_mode = 0;
+            } else if (strcmp(term->escape_buf + 1, "[?1004h") == 0) { /* Report focus in/out */
+                term->focus_report = 1;
+            } else if (strcmp(term->escape_buf + 1, "[?1004l") == 0) {
+                term->focus_report = 0;
+            } else if (strcmp(term->escape_buf + 1, "[?1049h") == 0) { /* Switch to alternate screen buffer */
+                image_remove(term, tile_on_alt, NULL);
+                term->use_alt_buffer = 1;
+                for (int r = 0; r < term->rows; r++) {
+                    term_clear_line(r, term->alt_data, term->alt_fg, term->alt_bg);
                 }
-                term.alt_row = 0;
-                term.alt_col = 0;
-            } else if (strcmp(escape_buf, "[?1049l") == 0) { /* Switch back to normal screen buffer */
-                term.use_alt_buffer = 0;
-                term.row = 0;
-                term.col = 0;
-            } else if (strcmp(escape_buf, "[?1h") == 0) { /* Enable application cursor keys */
-                /* No-op for now */
-            } else if (strcmp(escape_buf, "[?1l") == 0) { /* Disable application cursor keys */
-                /* No-op for now */
-            } else if (strcmp(escape_buf, "7") == 0) { /* Save cursor position (DECSC) */
-                if (term.use_alt_buffer) {
-                    saved_row = term.alt_row;
-                    saved_col = term.alt_col;
+                term->alt_row = 0;
+                term->alt_col = 0;
+            } else if (strcmp(term->escape_buf + 1, "[?1049l") == 0) { /* Switch back to normal screen buffer */
+                image_remove(term, tile_on_alt, NULL);
+                term->use_alt_buffer = 0;
+                term->kitty_depth[1] = 0;
+                term->row = 0;
+                term->col = 0;
+            } else if (strcmp(term->escape_buf + 1, "[?1h") == 0) { /* Enable application cursor keys */
+                term->appcursor = 1;
+            } else if (strcmp(term->escape_buf + 1, "[?1l") == 0) { /* Disable application cursor keys */
+                term->appcursor = 0;
+            } else if (strcmp(term->escape_buf + 1, "=") == 0) { /* Application keypad (DECKPAM) */
+                term->appkeypad = 1;
+            } else if (strcmp(term->escape_buf + 1, ">") == 0) { /* Normal keypad (DECKPNM) */
+                term->appkeypad = 0;
+            } else if (strcmp(term->escape_buf + 1, "[m") == 0) { /* Reset colors */
+                term->current_fg = defaultfg;
+                term->current_bg = defaultbg;
+            } else if (strcmp(term->escape_buf + 1, "7") == 0) { /* Save cursor position (DECSC) */
+                memcpy(term->saved_charsets, term->charsets, sizeof(term->charsets));
+                term->saved_gl = term->gl;
+                if (term->use_alt_buffer) {
+                    term->saved_row = term->alt_row;
+                    term->saved_col = term->alt_col;
                 } else {
-                    saved_row = term.row;
-                    saved_col = term.col;
+                    term->saved_row = term->row;
+                    term->saved_col = term->col;
                 }
-            } else if (strcmp(escape_buf, "8") == 0) { /* Restore cursor position (DECRC) */
-                if (term.use_alt_buffer) {
-                    term.alt_row = saved_row;
-                    term.alt_col = saved_col;
-                    if (term.alt_row < 0) term.alt_row = 0;
-                    if (term.alt_row >= xw.row) term.alt_row = xw.row - 1;
-                    if (term.alt_col < 0) term.alt_col = 0;
-                    if (term.alt_col >= xw.col) term.alt_col = xw.col - 1;
+            } else if (strcmp(term->escape_buf + 1, "8") == 0) { /* Restore cursor position (DECRC) */
+                memcpy(term->charsets, term->saved_charsets, sizeof(term->charsets));
+                term->gl = term->saved_gl;
+                if (term->use_alt_buffer) {
+                    term->alt_row = term->saved_row;
+                    term->alt_col = term->saved_col;
+                    if (term->alt_row < 0) term->alt_row = 0;
+                    if (term->alt_row >= term->rows) term->alt_row = term->rows - 1;
+                    if (term->alt_col < 0) term->alt_col = 0;
+                    if (term->alt_col >= term->cols) term->alt_col = term->cols - 1;
                 } else {
-                    term.row = saved_row;
-                    term.col = saved_col;
-                    if (term.row < 0) term.row = 0;
-                    if (term.row >= xw.row) term.row = xw.row - 1;
-                    if (term.col < 0) term.col = 0;
-                    if (term.col >= xw.col) term.col = xw.col - 1;
+                    term->row = term->saved_row;
+                    term->col = term->saved_col;
+                    if (term->row < 0) term->row = 0;
+                    if (term->row >= term->rows) term->row = term->rows - 1;
+                    if (term->col < 0) term->col = 0;
+                    if (term->col >= term->cols) term->col = term->cols - 1;
                 }
-            } else if (escape_buf[1] >= '0' && escape_buf[1] <= '9') {
+            } else if (term->escape_buf[term->escape_len - 1] == 'u' && strchr("?><=", term->escape_buf[2])) {
+                kitty_csi(term);
+            } else if (strncmp(term->escape_buf + 1, "[>4", 3) == 0 && term->escape_buf[term->escape_len - 1] == 'm') {
+                /* Set modifyOtherKeys: \033[>4;<level>m, level 0 if omitted */
+                term->modify_other_keys = term->escape_buf[4] == ';' ? atoi(term->escape_buf + 5) : 0;
+            } else if (term->escape_buf[2] >= '0' && term->escape_buf[2] <= '9') {
                 /* Handle cursor movement: \033[<n>C (move right) */
-                if (escape_buf[escape_len - 1] == 'C') {
-                    int n = atoi(escape_buf + 2);
-                    if (term.use_alt_buffer) {
-                        term.alt_col += n;
-                        if (term.alt_col >= xw.col) term.alt_col = xw.col - 1;
+                if (term->escape_buf[term->escape_len - 1] == 'C') {
+                    int n = atoi(term->escape_buf + 2);
+                    if (term->use_alt_buffer) {
+                        term->alt_col += n;
+                        if (term->alt_col >= term->cols) term->alt_col = term->cols - 1;
                     } else {
-                        term.col += n;
-                        if (term.col >= xw.col) term.col = xw.col - 1;
+                        term->col += n;
+                        if (term->col >= term->cols) term->col = term->cols - 1;
                     }
                 }
                 /* Handle cursor movement: \033[<n>A (move up) */
-                else if (escape_buf[escape_len - 1] == 'A') {
-                    int n = atoi(escape_buf + 2);
-                    if (term.use_alt_buffer) {
-                        term.alt_row -= n;
-                        if (term.alt_row < 0) term.alt_row = 0;
+                else if (term->escape_buf[term->escape_len - 1] == 'A') {
+                    int n = atoi(term->escape_buf + 2);
+                    if (term->use_alt_buffer) {
+                        term->alt_row -= n;
+                        if (term->alt_row < 0) term->alt_row = 0;
                     } else {
-                        term.row -= n;
-                        if (term.row < 0) term.row = 0;
+                        term->row -= n;
+                        if (term->row < 0) term->row = 0;
                     }
                 }
                 /* Handle cursor movement: \033[<n>B (move down) */
-                else if (escape_buf[escape_len - 1] == 'B') {
-                    int n = atoi(escape_buf + 2);
-                    if (term.use_alt_buffer) {
-                        term.alt_row += n;
-                        if (term.alt_row >= xw.row) term.alt_row = xw.row - 1;
+                else if (term->escape_buf[term->escape_len - 1] == 'B') {
+                    int n = atoi(term->escape_buf + 2);
+                    if (term->use_alt_buffer) {
+                        term->alt_row += n;
+                        if (term->alt_row >= term->rows) term->alt_row = term->rows - 1;
                     } else {
-                        term.row += n;
-                        if (term.row >= xw.row) term.row = xw.row - 1;
+                        term->row += n;
+                        if (term->row >= term->rows) term->row = term->rows - 1;
                     }
                 }
                 /* Handle cursor movement: \033[<n>D (move left) */
-                else if (escape_buf[escape_len - 1] == 'D') {
-                    int n = atoi(escape_buf + 2);
-                    if (term.use_alt_buffer) {
-                        term.alt_col -= n;
-                        if (term.alt_col < 0) term.alt_col = 0;
+                else if (term->escape_buf[term->escape_len - 1] == 'D') {
+                    int n = atoi(term->escape_buf + 2);
+                    if (term->use_alt_buffer) {
+                        term->alt_col -= n;
+                        if (term->alt_col < 0) term->alt_col = 0;
                     } else {
-                        term.col -= n;
-                        if (term.col < 0) term.col = 0;
+                        term->col -= n;
+                        if (term->col < 0) term->col = 0;
                     }
                 }
                 /* Handle cursor position: \033[<row>;<col>H */
-                else if (escape_buf[escape_len - 1] == 'H') {
+                else if (term->escape_buf[term->escape_len - 1] == 'H') {
                     int row = 1, col = 1;
-                    sscanf(escape_buf + 2, "%d;%d", &row, &col);
-                    if (term.use_alt_buffer) {
-                        term.alt_row = row - 1;
-                        term.alt_col = col - 1;
-                        if (term.alt_row < 0) term.alt_row = 0;
-                        if (term.alt_row >= xw.row) term.alt_row = xw.row - 1;
-                        if (term.alt_col < 0) term.alt_col = 0;
-                        if (term.alt_col >= xw.col) term.alt_col = xw.col - 1;
+                    sscanf(term->escape_buf + 2, "%d;%d", &row, &col);
+                    if (term->use_alt_buffer) {
+                        term->alt_row = row - 1;
+                        term->alt_col = col - 1;
+                        if (term->alt_row < 0) term->alt_row = 0;
+                        if (term->alt_row >= term->rows) term->alt_row = term->rows - 1;
+                        if (term->alt_col < 0) term->alt_col = 0;
+                        if (term->alt_col >= term->cols) term->alt_col = term->cols - 1;
                     } else {
-                        term.row = row - 1;
-                        term.col = col - 1;
-                        if (term.row < 0) term.row = 0;
-                        if (term.row >= xw.row) term.row = xw.row - 1;
-                        if (term.col < 0) term.col = 0;
-                        if (term.col >= xw.col) term.col = xw.col - 1;
+                        term->row = row - 1;
+                        term->col = col - 1;
+                        if (term->row < 0) term->row = 0;
+                        if (term->row >= term->rows) term->row = term->rows - 1;
+                        if (term->col < 0) term->col = 0;
+                        if (term->col >= term->cols) term->col = term->cols - 1;
                     }
                 }
                 /* Handle color sequences like \033[44;100m */
-                else if (escape_buf[escape_len - 1] == 'm') {
-                    char *ptr = escape_buf + 2;
+                else if (term->escape_buf[term->escape_len - 1] == 'm') {
+                    char *ptr = term->escape_buf + 2;
                     while (*ptr) {
                         int code = 0;
                         sscanf(ptr, "%d", &code);
                         if (code == 0) { /* Reset */
-                            current_fg = defaultfg;
-                            current_bg = defaultbg;
+                            term->current_fg = defaultfg;
+                            term->current_bg = defaultbg;
                         } else if (code >= 30 && code <= 37) { /* Foreground color */
-                            current_fg = code - 30;
+                            term->current_fg = code - 30;
                         } else if (code >= 40 && code <= 47) { /* Background color */
-                            current_bg = code - 40;
+                            term->current_bg = code - 40;
                         } else if (code >= 90 && code <= 97) { /* Bright foreground */
-                            current_fg = (code - 90) + 8;
+                            term->current_fg = (code - 90) + 8;
                         } else if (code >= 100 && code <= 107) { /* Bright background */
-                            current_bg = (code - 100) + 8;
+                            term->current_bg = (code - 100) + 8;
                         }
                         /* Move to the next code */
                         while (*ptr && *ptr != ';') ptr++;
@@ -412,61 +1523,61 @@ static void term_putc(char c) {
                     }
                 }
                 /* Handle scroll region: \033[<top>;<bottom>r */
-                else if (escape_buf[escape_len - 1] == 'r') {
-                    int top = 1, bottom = xw.row;
-                    sscanf(escape_buf + 2, "%d;%d", &top, &bottom);
-                    term.scroll_top = top - 1;
-                    term.scroll_bottom = bottom - 1;
-                    if (term.scroll_top < 0) term.scroll_top = 0;
-                    if (term.scroll_bottom >= xw.row) term.scroll_bottom = xw.row - 1;
+                else if (term->escape_buf[term->escape_len - 1] == 'r') {
+                    int top = 1, bottom = term->rows;
+                    sscanf(term->escape_buf + 2, "%d;%d", &top, &bottom);
+                    term->scroll_top = top - 1;
+                    term->scroll_bottom = bottom - 1;
+                    if (term->scroll_top < 0) term->scroll_top = 0;
+                    if (term->scroll_bottom >= term->rows) term->scroll_bottom = term->rows - 1;
                 }
                 /* Handle insert character: \033[<n>@ */
-                else if (escape_buf[escape_len - 1] == '@') {
-                    int n = atoi(escape_buf + 2);
+                else if (term->escape_buf[term->escape_len - 1] == '@') {
+                    int n = atoi(term->escape_buf + 2);
                     if (n <= 0) n = 1;
-                    char (*data)[MAX_COLS] = term.use_alt_buffer ? term.alt_data : term.data;
-                    int (*fg)[MAX_COLS] = term.use_alt_buffer ? term.alt_fg : term.fg;
-                    int (*bg)[MAX_COLS] = term.use_alt_buffer ? term.alt_bg : term.bg;
-                    int row = term.use_alt_buffer ? term.alt_row : term.row;
-                    int col = term.use_alt_buffer ? term.alt_col : term.col;
+                    char (*data)[MAX_COLS] = term->use_alt_buffer ? term->alt_data : term->data;
+                    int (*fg)[MAX_COLS] = term->use_alt_buffer ? term->alt_fg : term->fg;
+                    int (*bg)[MAX_COLS] = term->use_alt_buffer ? term->alt_bg : term->bg;
+                    int row = term->use_alt_buffer ? term->alt_row : term->row;
+                    int col = term->use_alt_buffer ? term->alt_col : term->col;
                     /* Shift characters right */
-                    for (int c = xw.col - 1; c >= col + n; c--) {
+                    for (int c = term->cols - 1; c >= col + n; c--) {
                         data[row][c] = data[row][c - n];
                         fg[row][c] = fg[row][c - n];
                         bg[row][c] = bg[row][c - n];
                     }
                     /* Clear the inserted space */
-                    for (int c = col; c < col + n && c < xw.col; c++) {
+                    for (int c = col; c < col + n && c < term->cols; c++) {
                         data[row][c] = 0;
                         fg[row][c] = defaultfg;
                         bg[row][c] = defaultbg;
                     }
                 }
             }
-            escape_len = 0;
+            term->escape_len = 0;
         }
         return;
     }
 
     if (c == '\033') { /* ESC */
-        in_escape = 1;
-        escape_len = 0;
-        escape_buf[escape_len++] = c;
+        term->in_escape = 1;
+        term->escape_len = 0;
+        term->escape_buf[term->escape_len++] = c;
         return;
     }
 
-    char (*data)[MAX_COLS] = term.use_alt_buffer ? term.alt_data : term.data;
-    int (*fg)[MAX_COLS] = term.use_alt_buffer ? term.alt_fg : term.fg;
-    int (*bg)[MAX_COLS] = term.use_alt_buffer ? term.alt_bg : term.bg;
-    int *row_ptr = term.use_alt_buffer ? &term.alt_row : &term.row;
-    int *col_ptr = term.use_alt_buffer ? &term.alt_col : &term.col;
+    char (*data)[MAX_COLS] = term->use_alt_buffer ? term->alt_data : term->data;
+    int (*fg)[MAX_COLS] = term->use_alt_buffer ? term->alt_fg : term->fg;
+    int (*bg)[MAX_COLS] = term->use_alt_buffer ? term->alt_bg : term->bg;
+    int *row_ptr = term->use_alt_buffer ? &term->alt_row : &term->row;
+    int *col_ptr = term->use_alt_buffer ? &term->alt_col : &term->col;
 
     if (c == '\n') {
         (*row_ptr)++;
         *col_ptr = 0;
-        if (*row_ptr > term.scroll_bottom) {
-            term_scroll_up();
-            *row_ptr = term.scroll_bottom;
+        if (*row_ptr > term->scroll_bottom) {
+            term_scroll_up(term);
+            *row_ptr = term->scroll_bottom;
         }
     } else if (c == '\r') {
         *col_ptr = 0;
@@ -477,20 +1588,25 @@ static void term_putc(char c) {
             fg[*row_ptr][*col_ptr] = defaultfg;
             bg[*row_ptr][*col_ptr] = defaultbg;
         }
+    } else if (c == 0x0e) { /* SO: G1 into GL */
+        term->gl = 1;
+    } else if (c == 0x0f) { /* SI: G0 into GL */
+        term->gl = 0;
     } else if (c >= 32 && c <= 126) { /* Printable characters */
-        if (*row_ptr < xw.row && *col_ptr < xw.col) {
-            data[*row_ptr][*col_ptr] = c;
-            fg[*row_ptr][*col_ptr] = current_fg;
-            bg[*row_ptr][*col_ptr] = current_bg;
-            (*col_ptr)++;
-            if (*col_ptr >= xw.col && wrap) {
-                (*row_ptr)++;
-                *col_ptr = 0;
-                if (*row_ptr > term.scroll_bottom) {
-                    term_scroll_up();
-                    *row_ptr = term.scroll_bottom;
-                }
-            }
+        int set = term->single_shift >= 0 ? term->single_shift : term->gl;
+        term->single_shift = -1;
+        term_print(term, term->charsets[set], &c, 1);
+    }
+}
+
+/* Feed output of a terminal's program to its parser. Everything it
+ * touches hangs off term, so terminals can be parsed independently. */
+static void term_write(Term *term, const char *buf, size_t n) {
+    for (size_t i = 0; i < n;) {
+        if (!term->in_escape && !term->in_str && term->single_shift < 0 && buf[i] >= 32 && buf[i] <= 126) {
+            i += term_print(term, term->charsets[term->gl], buf + i, n - i);
+        } else {
+            term_putc(term, buf[i++]);
         }
     }
 }
@@ -532,29 +1648,46 @@ static void exec_shell(const char *cmd, char **args) {
 }
 
 
-/* Handle SIGCHLD from the child process */
+/* Handle SIGCHLD. SIGCHLD is blocked outside of the main loop's wait,
+ * so reaping children and closing their panes is left to the loop. */
 static void sigchld_handler(int sig) {
-    int status;
-    pid_t pid = waitpid(child_pid, &status, WNOHANG);
-    if (pid == child_pid) {
-        if (WIFEXITED(status)) {
-            exit(WEXITSTATUS(status));
-        } else if (WIFSIGNALED(status)) {
-            exit(128 + WTERMSIG(status));
-        }
-    }
+    child_exited = 1;
+}
+
+/* Handle SIGHUP, blocked like SIGCHLD: the loop reloads the config */
+static void sighup_handler(int sig) {
+    config_reload = 1;
+}
+
+/* Block the signals the main loop handles; they are delivered only
+ * while it waits for events, with orig_sigmask */
+static void sig_init(void) {
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGHUP);
+    sigprocmask(SIG_BLOCK, &set, &orig_sigmask);
+    signal(SIGCHLD, sigchld_handler);
+    signal(SIGHUP, sighup_handler);
+}
+
+/* Exit with the status of a child process */
+static void child_exit(int status) {
+    if (WIFEXITED(status)) exit(WEXITSTATUS(status));
+    exit(128 + WTERMSIG(status));
 }
 
 /* Create a new PTY and fork the shell */
-int ptynew(const char *cmd, char **args) {
+int ptynew(Term *term, const char *cmd, char **args) {
     int master, slave;
-    struct winsize ws = {DEFAULT_ROWS, DEFAULT_COLS, 0, 0};
+    struct winsize ws = {term->rows, term->cols, 0, 0};
 
     if (openpty(&master, &slave, NULL, NULL, &ws) < 0) {
         die("openpty failed");
     }
 
-    switch (child_pid = fork()) {
+    switch (term->pid = fork()) {
     case -1:
         die("fork failed");
         break;
@@ -566,62 +1699,585 @@ int ptynew(const char *cmd, char **args) {
         dup2(slave, 1);
         dup2(slave, 2);
         close(slave);
+        sigprocmask(SIG_SETMASK, &orig_sigmask, NULL);
         exec_shell(cmd, args);
         break;
     default:
         close(slave);
-        master_fd = master;
-        signal(SIGCHLD, sigchld_handler);
-        return master_fd;
+        fcntl(master, F_SETFD, FD_CLOEXEC); /* Not for the other panes' children */
+        term->master_fd = master;
+        return term->master_fd;
     }
     return -1;
 }
 
-/* Read from the PTY and update the terminal buffer */
-size_t ttyread(void) {
-    static char buf[BUFSIZE];
-    ssize_t n = read(master_fd, buf, BUFSIZE);
-    if (n <= 0) {
-        if (n < 0) die("read from PTY failed");
-        exit(0);
-    }
-    /* Debug: Print raw PTY output */
-    fprintf(stderr, "ttyread: ");
-    for (ssize_t i = 0; i < n; i++) {
-        if (buf[i] == '\033') {
-            fprintf(stderr, "\\033");
-        } else {
-            fprintf(stderr, "%c", buf[i]);
+/* Write a whole buffer, retrying short writes */
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Session log writer thread. After a failed write it only drops the
+ * chunks and closes files; the main thread reports the error. */
+static void *log_writer(void *arg) {
+    pthread_mutex_lock(&log_lock);
+    for (;;) {
+        while (log_tail == log_head && !log_quit) {
+            pthread_cond_wait(&log_cond, &log_lock);
+        }
+        if (log_tail == log_head) break;
+        LogChunk *chunk = &log_ring[log_tail % LOG_RING_SLOTS];
+        pthread_mutex_unlock(&log_lock);
+
+        if (chunk->len && !__atomic_load_n(&log_error, __ATOMIC_RELAXED)) {
+            int failed = write_all(chunk->fd, chunk->buf, chunk->len) < 0;
+            if (!failed && chunk->timing_fd >= 0) {
+                /* scriptreplay(1) timing: delay since previous chunk, length */
+                char line[64];
+                int len = snprintf(line, sizeof(line), "%f %zu\n", chunk->delay, chunk->len);
+                failed = write_all(chunk->timing_fd, line, len) < 0;
+            }
+            if (failed) __atomic_store_n(&log_error, errno ? errno : EIO, __ATOMIC_RELEASE);
+        }
+        if (chunk->close) {
+            close(chunk->fd);
+            if (chunk->timing_fd >= 0) close(chunk->timing_fd);
+        }
+
+        pthread_mutex_lock(&log_lock);
+        __atomic_store_n(&log_tail, log_tail + 1, __ATOMIC_RELEASE);
+        pthread_cond_signal(&log_cond);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+/* Drain the session log on exit */
+static void log_close(void) {
+    if (!log_ring) return;
+    pthread_mutex_lock(&log_lock);
+    log_quit = 1;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+    if (!pthread_equal(pthread_self(), log_thread)) {
+        pthread_join(log_thread, NULL);
+    }
+    log_ring = NULL;
+}
+
+/* Start the session log writer thread */
+static void log_init(void) {
+    sigset_t all, old;
+
+    log_ring = xmalloc(LOG_RING_SLOTS * sizeof(LogChunk));
+
+    /* Signals are only ever handled by the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) != 0) {
+        die("pthread_create failed");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    atexit(log_close);
+}
+
+/* Open a terminal's log files: the names given for the first terminal,
+ * with .<id> appended for the others */
+static void log_open(Term *t) {
+    char name[PATH_MAX];
+
+    t->log_fd = t->log_timing_fd = -1;
+    if (!log_ring || log_stopped) return;
+    if (t->id == 1) snprintf(name, sizeof(name), "%s", log_name);
+    else snprintf(name, sizeof(name), "%s.%u", log_name, t->id);
+    t->log_fd = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (t->log_fd < 0) die("open %s failed", name);
+    if (log_timing_name) {
+        if (t->id == 1) snprintf(name, sizeof(name), "%s", log_timing_name);
+        else snprintf(name, sizeof(name), "%s.%u", log_timing_name, t->id);
+        t->log_timing_fd = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (t->log_timing_fd < 0) die("open %s failed", name);
+    }
+}
+
+/* Whether the session log has no free slot for another read */
+static int log_full(void) {
+    return log_ring &&
+           log_head - __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS;
+}
+
+/* Next free log slot, waiting for the writer only if the ring is full */
+static LogChunk *log_reserve(void) {
+    if (log_full()) {
+        pthread_mutex_lock(&log_lock);
+        while (log_head - log_tail >= LOG_RING_SLOTS) {
+            pthread_cond_wait(&log_cond, &log_lock);
         }
+        pthread_mutex_unlock(&log_lock);
+    }
+    return &log_ring[log_head % LOG_RING_SLOTS];
+}
+
+/* Hand a filled log slot to the writer thread */
+static void log_push(void) {
+    pthread_mutex_lock(&log_lock);
+    log_head++;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+}
+
+/* Have the writer close a terminal's log files after what it logged */
+static void log_release(Term *t) {
+    if (t->log_fd < 0) return;
+    LogChunk *chunk = log_reserve();
+    chunk->fd = t->log_fd;
+    chunk->timing_fd = t->log_timing_fd;
+    chunk->len = 0;
+    chunk->close = 1;
+    log_push();
+    t->log_fd = t->log_timing_fd = -1;
+}
+
+/* Report a failed log write once and stop logging every terminal */
+static void log_stop(void) {
+    fprintf(stderr, "slimterm: writing the session log failed: %s; logging stopped\n", strerror(log_error));
+    log_stopped = 1;
+    for (int i = 0; i < ntabs; i++) {
+        for (int p = 0; p < tabs[i].npanes; p++) log_release(tabs[i].panes[p]);
+    }
+}
+
+/* Slot for a read from a terminal's PTY, NULL if it is not logged */
+static LogChunk *log_slot(Term *t) {
+    if (t->log_fd < 0) return NULL;
+    if (__atomic_load_n(&log_error, __ATOMIC_ACQUIRE)) {
+        log_stop();
+        return NULL;
+    }
+    return log_reserve();
+}
+
+/* Hand a slot filled with a terminal's output to the writer thread */
+static void log_commit(Term *t, LogChunk *chunk, size_t len) {
+    chunk->fd = t->log_fd;
+    chunk->timing_fd = t->log_timing_fd;
+    chunk->len = len;
+    chunk->close = 0;
+    if (t->log_timing_fd >= 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        chunk->delay = t->log_last.tv_sec ? TIMEDIFF(now, t->log_last) / 1000 : 0;
+        t->log_last = now;
+    }
+    log_push();
+}
+
+/* The slave side was closed. The child is normally exiting by then:
+ * stop reading the PTY and leave closing the pane to child_reap(), so
+ * the child's exit status is kept. */
+static void ttyhangup(Term *t) {
+    t->hung_up = 1;
+}
+
+/* Whether events were already read into the client-side queue */
+static int xqueued(void) {
+#ifdef XCB
+    if (!xw.xcb_queued && (xw.xcb_queue[0] = xcb_poll_for_queued_event(xw.xc))) xw.xcb_queued = 1;
+    return xw.xcb_queued > 0;
+#else
+    return XEventsQueued(xw.dpy, QueuedAlready);
+#endif
+}
+
+/* Whether X events are waiting, without blocking */
+static int xinput_pending(void) {
+    struct pollfd pfd = {ConnectionNumber(xw.dpy), POLLIN, 0};
+    return xqueued() || poll(&pfd, 1, 0) > 0;
+}
+
+/* Feed PTY output to the parser. Between slices, the X queue is
+ * checked for a key that interrupts the program: the rest of the
+ * output is then dropped, as ttyflushintr will flush what follows.
+ * Events are only handled after the parse. */
+static void ttyparse(Term *term, const char *buf, size_t n) {
+    /* A view wholly in the history that stays on its lines shows
+     * nothing output changes, except its count of new lines */
+    int offscreen = -term->scroll_offset >= term->rows;
+    long long view = term->lines_scrolled + term->scroll_offset;
+    int new_lines = term->new_lines;
+
+    for (size_t i = 0; i < n; i += PARSE_SLICE) {
+        if (i > 0 && xinput_pending() && xintr_pending(term)) break;
+        term_write(term, buf + i, MIN(n - i, PARSE_SLICE));
     }
-    fprintf(stderr, "\n");
-    for (ssize_t i = 0; i < n; i++) {
-        term_putc(buf[i]);
+    if (!tabs_visible(term)) return;
+    if (!offscreen || term->lines_scrolled + term->scroll_offset != view) dirty = 1;
+    else if (term->new_lines != new_lines) badges_stale = 1;
+}
+
+/* Read from a terminal's PTY and update its buffer */
+size_t ttyread(Term *t) {
+    static char rbuf[BUFSIZE];
+    LogChunk *chunk = log_slot(t);
+    char *buf = chunk ? chunk->buf : rbuf;
+
+    ssize_t n = read(t->master_fd, buf, chunk ? LOG_CHUNK_SIZE : BUFSIZE);
+    if (n <= 0) {
+        /* EIO means the slave side was closed */
+        if (n < 0 && errno != EIO) die("read from PTY failed");
+        ttyhangup(t);
+        return 0;
     }
+    if (chunk) log_commit(t, chunk, n);
+    ttyparse(t, buf, n);
     return n;
 }
 
+/* Read a terminal's line discipline settings into its copy */
+static void ttygetattr(Term *t, struct timespec now) {
+    if (tcgetattr(t->master_fd, &t->tio) < 0) memset(&t->tio, 0, sizeof(t->tio));
+    t->tio_time = now;
+}
+
+/* Whether the settings make a byte interrupt, quit or suspend */
+static int ttysignals(const struct termios *tio, unsigned char c) {
+    return c != _POSIX_VDISABLE && (tio->c_lflag & ISIG) &&
+           (c == tio->c_cc[VINTR] || c == tio->c_cc[VQUIT] || c == tio->c_cc[VSUSP]);
+}
+
+/* Whether a byte typed into a terminal signals its child. The copy of
+ * the settings is read again once it is a second old, and whenever it
+ * says yes: a program may have turned ISIG off since. */
+static int ttyintr(Term *t, unsigned char c) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int stale = TIMEDIFF(now, t->tio_time) >= 1000;
+    if (stale) ttygetattr(t, now);
+    if (!ttysignals(&t->tio, c)) return 0;
+    if (!stale) ttygetattr(t, now);
+    return ttysignals(&t->tio, c);
+}
+
+/* After the user interrupted, quit or suspended the child, discard the
+ * output it produced before the signal, like stty flusho: drawing it
+ * would only delay the prompt coming back */
+static void ttyflushintr(Term *term, char c) {
+    if (!ttyintr(term, c)) return;
+    tcflush(term->master_fd, TCIFLUSH);
+}
+
 /* Write to the PTY */
-void ttywrite(const char *s, size_t n) {
-    xwrite(master_fd, s, n);
-    /* Debug: Print what we're writing to the PTY */
-    fprintf(stderr, "ttywrite: ");
-    for (size_t i = 0; i < n; i++) {
-        if (s[i] == '\033') {
-            fprintf(stderr, "\\033");
-        } else {
-            fprintf(stderr, "%c", s[i]);
+void ttywrite(Term *term, const char *s, size_t n) {
+    if (term->hung_up) return;
+    xwrite(term->master_fd, s, n);
+    if (FLUSH_ON_INTERRUPT && n == 1) ttyflushintr(term, s[0]);
+}
+
+/* Move a terminal's pane and resize its PTY and buffer to match */
+static void term_resize(Term *t, int x, int y, int cols, int rows) {
+    t->x = x;
+    t->y = y;
+    t->cell_w = xw.font_width;
+    t->cell_h = xw.font_height;
+    cols = MAX(MIN(cols, MAX_COLS), 1);
+    rows = MAX(MIN(rows, MAX_ROWS), 1);
+    if (cols == t->cols && rows == t->rows) return;
+
+    struct winsize ws = {(short)rows, (short)cols, 0, 0};
+    if (ioctl(t->master_fd, TIOCSWINSZ, &ws) < 0) {
+        fprintf(stderr, "ioctl TIOCSWINSZ failed: %s\n", strerror(errno));
+    }
+    t->cols = cols;
+    t->rows = rows;
+    t->scroll_bottom = rows - 1;
+    /* Adjust cursor position */
+    if (t->use_alt_buffer) {
+        if (t->alt_row >= rows) t->alt_row = rows - 1;
+        if (t->alt_col >= cols) t->alt_col = cols - 1;
+    } else {
+        if (t->row >= rows) t->row = rows - 1;
+        if (t->col >= cols) t->col = cols - 1;
+    }
+}
+
+/* Whether a terminal is shown, that is in the current tab */
+static int tabs_visible(Term *t) {
+    for (int p = 0; p < tabs[curtab].npanes; p++) {
+        if (tabs[curtab].panes[p] == t) return 1;
+    }
+    return 0;
+}
+
+/* The terminal keyboard input goes to */
+static Term *term_focused(void) {
+    return tabs[curtab].panes[tabs[curtab].focus];
+}
+
+/* Lay out the panes of every tab, below the tab bar when there is more
+ * than one tab. Panes share the space evenly, one cell apart. Inactive
+ * tabs are laid out too, so their programs see the right size. */
+static void layout(void) {
+    int top = ntabs > 1;
+
+    for (int i = 0; i < ntabs; i++) {
+        Tab *tab = &tabs[i];
+        int avail = (tab->stacked ? xw.row - top : xw.col) - (tab->npanes - 1);
+        for (int p = 0, pos = 0; p < tab->npanes; p++) {
+            int size = avail / tab->npanes + (p < avail % tab->npanes);
+            if (tab->stacked) term_resize(tab->panes[p], 0, top + pos, xw.col, size);
+            else term_resize(tab->panes[p], pos, top, size, xw.row - top);
+            pos += size + 1;
         }
     }
-    fprintf(stderr, "\n");
+    dirty = 1;
 }
 
-/* Resize the PTY and terminal buffer */
-void ttyresize(int col, int row) {
-    struct winsize ws = {(short)row, (short)col, 0, 0};
-    if (ioctl(master_fd, TIOCSWINSZ, &ws) < 0) {
-        fprintf(stderr, "ioctl TIOCSWINSZ failed: %s\n", strerror(errno));
+/* Tell the programs in two panes that input moved from one to the other */
+static void term_refocus(Term *from, Term *to) {
+    if (!xw.focused || from == to) return;
+    if (from && from->focus_report) ttywrite(from, "\033[O", 3);
+    if (to && to->focus_report) ttywrite(to, "\033[I", 3);
+}
+
+/* Start a terminal running cmd, or the shell */
+static Term *term_new(const char *cmd, char **args) {
+    Term *t = calloc(1, sizeof(Term));
+    if (!t) die("calloc failed");
+    t->id = ++term_ids;
+    log_open(t);
+    t->cols = MIN(xw.col, MAX_COLS);
+    t->rows = MIN(xw.row, MAX_ROWS);
+    t->cell_w = xw.font_width;
+    t->cell_h = xw.font_height;
+    term_init(t);
+    term_scrollback_resize(t, scrollback_size);
+    ptynew(t, cmd, args);
+    return t;
+}
+
+/* Free a terminal and everything it holds */
+static void term_free(Term *t) {
+    for (int i = 0; i < t->ntiles; i++) image_unref(t->tiles[i].img);
+    while (t->kitty_nstored) image_unstore(t, t->kitty_store[0]);
+    close(t->master_fd);
+    log_release(t);
+    free(t->tiles);
+    free(t->kitty_store);
+    free(t->sixel.pixels);
+    free(t->apc_buf);
+    free(t->kgr.data);
+    free(t->scrollback);
+    free(t->scrollback_fg);
+    free(t->scrollback_bg);
+    free(t);
+}
+
+/* Open a tab running cmd, or the shell */
+static void tab_new(const char *cmd, char **args) {
+    if (ntabs == MAX_TABS) return;
+    Term *prev = ntabs ? term_focused() : NULL;
+    Tab *tab = &tabs[ntabs];
+    memset(tab, 0, sizeof(*tab));
+    tab->panes[0] = term_new(cmd, args);
+    tab->npanes = 1;
+    curtab = ntabs++;
+    layout();
+    term_refocus(prev, term_focused());
+}
+
+/* Split the focused pane, side by side or stacked */
+static void tab_split(int stacked) {
+    Tab *tab = &tabs[curtab];
+    int space = (stacked ? xw.row - (ntabs > 1) : xw.col) - tab->npanes;
+
+    if (tab->npanes == MAX_PANES || space / (tab->npanes + 1) < 2) return;
+    Term *prev = term_focused();
+    memmove(tab->panes + tab->focus + 2, tab->panes + tab->focus + 1,
+            (tab->npanes - tab->focus - 1) * sizeof(Term *));
+    tab->panes[++tab->focus] = term_new(NULL, NULL);
+    tab->npanes++;
+    tab->stacked = stacked;
+    layout();
+    term_refocus(prev, term_focused());
+}
+
+/* Switch to the tab or pane delta positions away */
+static void tab_select(int delta) {
+    Term *prev = term_focused();
+    curtab = (curtab + delta + ntabs) % ntabs;
+    term_refocus(prev, term_focused());
+    dirty = 1;
+}
+
+static void tab_focus(int delta) {
+    Tab *tab = &tabs[curtab];
+    Term *prev = term_focused();
+    tab->focus = (tab->focus + delta + tab->npanes) % tab->npanes;
+    term_refocus(prev, term_focused());
+    dirty = 1;
+}
+
+/* Close a terminal whose program ended. With the last one gone,
+ * slimterm exits with that program's status. */
+static void term_close(Term *t, int status) {
+    for (int i = 0; i < ntabs; i++) {
+        Tab *tab = &tabs[i];
+        for (int p = 0; p < tab->npanes; p++) {
+            if (tab->panes[p] != t) continue;
+            memmove(tab->panes + p, tab->panes + p + 1, (tab->npanes - p - 1) * sizeof(Term *));
+            tab->npanes--;
+            if (tab->focus > p || tab->focus == tab->npanes) tab->focus = MAX(tab->focus - 1, 0);
+            if (tab->npanes == 0) {
+                memmove(tabs + i, tabs + i + 1, (ntabs - i - 1) * sizeof(Tab));
+                ntabs--;
+                if (curtab > i || curtab == ntabs) curtab = MAX(curtab - 1, 0);
+            }
+            term_free(t);
+            if (ntabs == 0) child_exit(status);
+            layout();
+            return;
+        }
+    }
+}
+
+/* Find the terminal running a process */
+static Term *term_find(pid_t pid) {
+    for (int i = 0; i < ntabs; i++) {
+        for (int p = 0; p < tabs[i].npanes; p++) {
+            if (tabs[i].panes[p]->pid == pid) return tabs[i].panes[p];
+        }
+    }
+    return NULL;
+}
+
+/* Close the panes whose programs exited */
+static void child_reap(void) {
+    int status;
+    pid_t pid;
+
+    child_exited = 0;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        Term *t = term_find(pid);
+        if (t && (WIFEXITED(status) || WIFSIGNALED(status))) term_close(t, status);
+    }
+}
+
+/* Close a font set's font and free its glyph masks */
+static void font_close(FontSet *fs) {
+    if (!fs->font) return;
+    if (fs->box_mask) XRenderFreePicture(xw.dpy, fs->box_mask);
+    if (fs->box_pixmap) XFreePixmap(xw.dpy, fs->box_pixmap);
+    XftFontClose(xw.dpy, fs->font);
+    memset(fs, 0, sizeof(*fs));
+}
+
+/* Keep an open font as a font set of the given size at the current
+ * DPI, in place of the least recently used one */
+static FontSet *font_add(XftFont *font, double size) {
+    FontSet *fs = &xw.fonts[0];
+    XGlyphInfo extents;
+
+    for (int i = 1; i < FONT_CACHE_SIZE; i++) {
+        if (xw.fonts[i].used < fs->used) fs = &xw.fonts[i];
+    }
+    font_close(fs);
+    fs->font = font;
+    fs->size = size;
+    fs->dpi = xw.dpi;
+    XftTextExtentsUtf8(xw.dpy, font, (FcChar8 *)"M", 1, &extents);
+    fs->width = extents.xOff;
+    fs->height = font->ascent + font->descent;
+    return fs;
+}
+
+/* Open a font by name at a size in points, scaled to the screen's DPI.
+ * A size of 0 is set to the one the name asks for. */
+static XftFont *font_match(const char *name, double *size) {
+    FcPattern *pattern = FcNameParse((FcChar8 *)name);
+    FcResult result;
+    double pixels;
+
+    if (!pattern) return NULL;
+    if (!*size && FcPatternGetDouble(pattern, FC_SIZE, 0, size) != FcResultMatch) {
+        /* Pixel sizes are taken to be meant for 96 DPI */
+        if (FcPatternGetDouble(pattern, FC_PIXEL_SIZE, 0, &pixels) == FcResultMatch) *size = pixels * 72 / 96;
+        else *size = 12;
+    }
+    FcPatternDel(pattern, FC_PIXEL_SIZE);
+    FcPatternDel(pattern, FC_SIZE);
+    FcPatternDel(pattern, FC_DPI);
+    FcPatternAddDouble(pattern, FC_SIZE, *size);
+    FcPatternAddDouble(pattern, FC_DPI, xw.dpi);
+    FcPattern *match = XftFontMatch(xw.dpy, DefaultScreen(xw.dpy), pattern, &result);
+    FcPatternDestroy(pattern);
+    if (!match) return NULL;
+    XftFont *font = XftFontOpenPattern(xw.dpy, match);
+    if (!font) FcPatternDestroy(match);
+    return font;
+}
+
+/* Find the font set of a size at the current DPI, opening font_name at
+ * that size if none is cached; NULL if it cannot be opened */
+static FontSet *font_open(double size) {
+    for (int i = 0; i < FONT_CACHE_SIZE; i++) {
+        FontSet *fs = &xw.fonts[i];
+        if (fs->font && fs->size == size && fs->dpi == xw.dpi) return fs;
     }
+
+    XftFont *font = font_match(font_name, &size);
+    return font ? font_add(font, size) : NULL;
+}
+
+/* Draw with a font set from now on */
+static void font_use(FontSet *fs) {
+    static unsigned long tick;
+
+    fs->used = ++tick;
+    xw.fontset = fs;
+    xw.font = fs->font;
+    xw.font_width = fs->width;
+    xw.font_height = fs->height;
+}
+
+/* Open a font by name in place of all font sets; -1 if it cannot be */
+static int font_load(const char *name) {
+    double size = 0;
+    XftFont *font = font_match(name, &size);
+
+    if (!font) return -1;
+    for (int i = 0; i < FONT_CACHE_SIZE; i++) font_close(&xw.fonts[i]);
+    xw.font_size = size;
+    font_use(font_add(font, size));
+    return 0;
+}
+
+/* Give the panes as many cells as the window now holds, keeping its size */
+static void xfit(void) {
+    xw.col = MAX((xw.w - 2 * xw.border) / xw.font_width, 1);
+    xw.row = MAX((xw.h - 2 * xw.border) / xw.font_height, 1);
+    layout();
+}
+
+/* Change the font size, 0 for the configured one */
+static void zoom(double delta) {
+    FontSet *fs = font_open(delta ? MAX(xw.fontset->size + delta, 1) : xw.font_size);
+
+    if (!fs || fs == xw.fontset) return;
+    font_use(fs);
+    xfit();
+}
+
+/* Resize the window to a number of cells and lay out the panes again */
+static void xresize(int col, int row) {
     xw.col = col;
     xw.row = row;
     xw.w = col * xw.font_width + 2 * xw.border;
@@ -631,27 +2287,81 @@ void ttyresize(int col, int row) {
     if (xw.pixmap) {
         XFreePixmap(xw.dpy, xw.pixmap);
     }
-    xw.pixmap = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h, DefaultDepth(xw.dpy, DefaultScreen(xw.dpy)));
+    xw.pixmap = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h, xw.depth);
     XftDrawChange(xw.draw, xw.pixmap);
-    term.scroll_bottom = xw.row - 1;
-    /* Adjust cursor position */
-    if (term.use_alt_buffer) {
-        if (term.alt_row >= xw.row) term.alt_row = xw.row - 1;
-        if (term.alt_col >= xw.col) term.alt_col = xw.col - 1;
-    } else {
-        if (term.row >= xw.row) term.row = xw.row - 1;
-        if (term.col >= xw.col) term.col = xw.col - 1;
+    layout();
+}
+
+/* Border width in pixels at the screen's DPI */
+static int xborder(void) {
+    return border_width * xw.dpi / 96 + 0.5;
+}
+
+/* DPI that X resources set with Xft.dpi, 0 if they do not */
+static double resource_dpi(const char *resources) {
+    XrmDatabase db;
+    XrmValue value;
+    char *type;
+    double dpi = 0;
+
+    XrmInitialize();
+    if (!(db = XrmGetStringDatabase(resources))) return 0;
+    if (XrmGetResource(db, "Xft.dpi", "Xft.Dpi", &type, &value) && value.addr) dpi = atof(value.addr);
+    XrmDestroyDatabase(db);
+    return MAX(dpi, 0);
+}
+
+/* The screen's DPI: Xft.dpi in the current RESOURCE_MANAGER property,
+ * which the connection's copy of it would miss changes to, or else the
+ * physical size the server reports */
+static double xdpi(void) {
+    int screen = DefaultScreen(xw.dpy);
+    unsigned char *data = NULL;
+    unsigned long n, after;
+    double dpi = 0;
+    Atom type;
+    int format;
+
+    if (XGetWindowProperty(xw.dpy, RootWindow(xw.dpy, screen), xw.atoms[ATOM_RESOURCE_MANAGER], 0,
+                           SELECTION_MAX / 4, False, XA_STRING, &type, &format, &n, &after,
+                           &data) == Success && data) {
+        dpi = resource_dpi((char *)data);
+        XFree(data);
+    }
+    if (!dpi && DisplayWidthMM(xw.dpy, screen) > 0) {
+        dpi = DisplayWidth(xw.dpy, screen) * 25.4 / DisplayWidthMM(xw.dpy, screen);
     }
+    return dpi > 0 ? dpi : 96;
+}
+
+/* Follow a change of the DPI: switch to the font set of the same size
+ * in points at the new DPI, scale the border and resize the window to
+ * keep its cells. Font sets of the old DPI stay cached for a move back.
+ * Runs before a frame is drawn, not from the event handler. */
+static void xrescale(void) {
+    double dpi = xdpi(), old = xw.dpi;
+    FontSet *fs;
+
+    xw.dpi_stale = 0;
+    if (dpi == xw.dpi) return;
+    xw.dpi = dpi;
+    if (!(fs = font_open(xw.fontset->size))) {
+        xw.dpi = old;
+        return;
+    }
+    font_use(fs);
+    xw.border = xborder();
+    xresize(xw.col, xw.row);
 }
 
 /* Copy selected text to clipboard */
-static void copy_selection(void) {
-    if (term.sel_start_row == -1 || term.sel_end_row == -1) return;
+static void copy_selection(Term *term) {
+    if (term->sel_start_row == -1 || term->sel_end_row == -1) return;
 
-    int start_row = MIN(term.sel_start_row, term.sel_end_row);
-    int end_row = MAX(term.sel_start_row, term.sel_end_row);
-    int start_col = term.sel_start_row < term.sel_end_row ? term.sel_start_col : term.sel_end_col;
-    int end_col = term.sel_start_row < term.sel_end_row ? term.sel_end_col : term.sel_start_col;
+    int start_row = MIN(term->sel_start_row, term->sel_end_row);
+    int end_row = MAX(term->sel_start_row, term->sel_end_row);
+    int start_col = term->sel_start_row < term->sel_end_row ? term->sel_start_col : term->sel_end_col;
+    int end_col = term->sel_start_row < term->sel_end_row ? term->sel_end_col : term->sel_start_col;
 
     char *sel_text = xmalloc(MAX_COLS * (end_row - start_row + 1) + 1);
     int pos = 0;
@@ -659,386 +2369,2251 @@ static void copy_selection(void) {
     for (int r = start_row; r <= end_row; r++) {
         int src_row;
         char *data;
-        if (r < term.scrollback_len) {
-            src_row = (term.scrollback_pos - term.scrollback_len + r + SCROLLBACK_SIZE) % SCROLLBACK_SIZE;
-            data = term.scrollback[src_row];
+        if (r < term->scrollback_len) {
+            src_row = scrollback_row(term, r);
+            data = term->scrollback[src_row];
         } else {
-            src_row = r - term.scrollback_len;
-            if (src_row >= xw.row) break;
-            data = term.use_alt_buffer ? term.alt_data[src_row] : term.data[src_row];
+            src_row = r - term->scrollback_len;
+            if (src_row >= term->rows) break;
+            data = term->use_alt_buffer ? term->alt_data[src_row] : term->data[src_row];
         }
 
         int c_start = (r == start_row) ? start_col : 0;
-        int c_end = (r == end_row) ? end_col : xw.col - 1;
+        int c_end = (r == end_row) ? end_col : term->cols - 1;
         for (int c = c_start; c <= c_end; c++) {
             if (data[c]) {
-                sel_text[pos++] = data[c];
+                unsigned char ch = data[c];
+                sel_text[pos++] = ch < 32 ? dec_latin1[ch] : ch;
             }
         }
         if (r < end_row) sel_text[pos++] = '\n';
     }
     sel_text[pos] = '\0';
 
-    Atom clipboard = XInternAtom(xw.dpy, "CLIPBOARD", False);
-    XSetSelectionOwner(xw.dpy, clipboard, xw.win, CurrentTime);
-    XChangeProperty(xw.dpy, xw.win, clipboard, XA_STRING, 8, PropModeReplace,
+    XSetSelectionOwner(xw.dpy, xw.atoms[ATOM_CLIPBOARD], xw.win, CurrentTime);
+    XChangeProperty(xw.dpy, xw.win, xw.atoms[ATOM_CLIPBOARD], XA_STRING, 8, PropModeReplace,
                     (unsigned char *)sel_text, strlen(sel_text));
     free(sel_text);
 }
 
+/* Unlink the published screen segment on exit */
+static void shm_cleanup(void) {
+    if (shm) {
+        munmap(shm, sizeof(ShmScreen));
+        shm_unlink(shm_name);
+        shm = NULL;
+    }
+}
+
+/* Create the shared-memory segment external tools read the screen from */
+static void shm_init(void) {
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) die("shm_open %s failed", shm_name);
+    if (ftruncate(fd, sizeof(ShmScreen)) < 0) die("ftruncate failed");
+    shm = mmap(NULL, sizeof(ShmScreen), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) die("mmap failed");
+    shm->magic = SHM_MAGIC;
+    shm->version = SHM_VERSION;
+    shm->stride = MAX_COLS;
+    atexit(shm_cleanup);
+    /* Let programs running inside the terminal find their own screen */
+    setenv("SLIMTERM_SHM", shm_name, 1);
+}
+
+/* Publish the current screen to the shared-memory segment.
+ * The sequence counter is odd while the frame is being written;
+ * readers retry until they see the same even value before and after
+ * copying. */
+static void shm_publish(Term *term) {
+    char (*data)[MAX_COLS] = term->use_alt_buffer ? term->alt_data : term->data;
+    int (*fg)[MAX_COLS] = term->use_alt_buffer ? term->alt_fg : term->fg;
+    int (*bg)[MAX_COLS] = term->use_alt_buffer ? term->alt_bg : term->bg;
+    uint32_t seq = shm->seq;
+
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    shm->rows = term->rows;
+    shm->cols = term->cols;
+    shm->cur_row = term->use_alt_buffer ? term->alt_row : term->row;
+    shm->cur_col = term->use_alt_buffer ? term->alt_col : term->col;
+    shm->scroll_offset = term->scroll_offset;
+    shm->mouse_mode = term->mouse_enabled ? term->mouse_mode : 0;
+    shm->modes = (term->use_alt_buffer ? SHM_MODE_ALTSCREEN : 0) |
+                 (term->wrap ? SHM_MODE_WRAP : 0) |
+                 (term->appcursor ? SHM_MODE_APPCURSOR : 0) |
+                 (term->appkeypad ? SHM_MODE_APPKEYPAD : 0);
+    for (int r = 0; r < term->rows; r++) {
+        ShmCell *cell = &shm->cells[r * MAX_COLS];
+        for (int c = 0; c < term->cols; c++) {
+            cell[c].ch = cell_rune(data[r][c]);
+            cell[c].fg = fg[r][c];
+            cell[c].bg = bg[r][c];
+        }
+    }
+    shm->generation++;
+
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+#ifndef XCB
+/* XIM talks to the input method through Xlib's event queue, so it is
+ * not available when XCB owns the queue */
+static int ximopen(Display *dpy);
+
+/* An input method became available: connect to it */
+static void ximinstantiate(Display *dpy, XPointer client, XPointer call) {
+    if (ximopen(dpy)) {
+        XUnregisterIMInstantiateCallback(dpy, NULL, NULL, NULL, ximinstantiate, NULL);
+    }
+}
+
+/* The input method went away: wait for it to come back */
+static void ximdestroy(XIM xim, XPointer client, XPointer call) {
+    xw.xim = NULL;
+    xw.xic = NULL;
+    XRegisterIMInstantiateCallback(xw.dpy, NULL, NULL, NULL, ximinstantiate, NULL);
+}
+
+/* Open the input method and create the input context. The preedit spot
+ * is passed by reference through xw.spotlist, so moving it later is a
+ * single XSetICValues. */
+static int ximopen(Display *dpy) {
+    XIMCallback destroy = {NULL, ximdestroy};
+    unsigned long filter = 0;
+
+    xw.xim = XOpenIM(dpy, NULL, NULL, NULL);
+    if (!xw.xim) return 0;
+    if (XSetIMValues(xw.xim, XNDestroyCallback, &destroy, NULL)) {
+        fprintf(stderr, "slimterm: could not set XNDestroyCallback\n");
+    }
+    if (!xw.spotlist) xw.spotlist = XVaCreateNestedList(0, XNSpotLocation, &xw.spot, NULL);
+    xw.xic = XCreateIC(xw.xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
+                       XNClientWindow, xw.win, XNFocusWindow, xw.win,
+                       XNPreeditAttributes, xw.spotlist, NULL);
+    if (!xw.xic) {
+        fprintf(stderr, "slimterm: XCreateIC failed\n");
+        return 1;
+    }
+    if (!XGetICValues(xw.xic, XNFilterEvents, &filter, NULL)) {
+        XSelectInput(dpy, xw.win, XEVENT_MASK | filter);
+    }
+    return 1;
+}
+#endif
+
+/* Move the input method's preedit spot to the cursor, if it moved */
+static void ximspot(Term *term) {
+    int row = term->use_alt_buffer ? term->alt_row : term->row;
+    int col = term->use_alt_buffer ? term->alt_col : term->col;
+    XPoint spot = {xw.border + (term->x + col) * xw.font_width,
+                   xw.border + (term->y + row + 1) * xw.font_height};
+
+    if (!xw.xic || (spot.x == xw.spot.x && spot.y == xw.spot.y)) return;
+    xw.spot = spot;
+    XSetICValues(xw.xic, XNPreeditAttributes, xw.spotlist, NULL);
+}
+
+#ifdef PRESENT
+/* Track presented frames. A completion gives the MSC the next frame is
+ * aimed past and, with the previous one, the refresh period; the pixmap
+ * may be drawn into again once it is also idle. */
+static void xpresentevent(void *data, int type) {
+    if (type == PresentCompleteNotify) {
+        XPresentCompleteNotifyEvent *e = data;
+        if (e->serial_number != xw.present_serial) return;
+        if (e->kind == PresentCompleteKindPixmap && e->msc > xw.present_msc && xw.present_ust) {
+            double period = (double)(e->ust - xw.present_ust) / (e->msc - xw.present_msc) / 1000;
+            if (period >= 2 && period <= 100) xw.present_period = period;
+        }
+        xw.present_msc = e->msc;
+        xw.present_ust = e->ust;
+        xw.present_pending &= ~PRESENT_COMPLETE;
+    } else if (type == PresentIdleNotify) {
+        XPresentIdleNotifyEvent *e = data;
+        if (e->serial_number == xw.present_serial) xw.present_pending &= ~PRESENT_IDLE;
+    }
+}
+
+/* Use the Present extension to draw in step with the display */
+static void xpresentinit(void) {
+    int opcode, event, error;
+    if (!XPresentQueryExtension(xw.dpy, &opcode, &event, &error)) return;
+    xw.present = opcode;
+    xw.present_period = FRAME_INTERVAL;
+    XPresentSelectInput(xw.dpy, xw.win, PresentCompleteNotifyMask | PresentIdleNotifyMask);
+}
+#endif
+
+/* Called by Xlib after each request. Xlib only reads up to its latest
+ * request when it waits for a reply, so that counts as a round trip;
+ * events read at the same time can be miscounted as one. */
+static int xafter(Display *dpy) {
+    unsigned long read = LastKnownRequestProcessed(dpy);
+    if (read != x_last_read && read == NextRequest(dpy) - 1) x_roundtrips++;
+    x_last_read = read;
+    return 0;
+}
+
+/* Report the round trips and requests of the frame just drawn */
+static void xdebugframe(void) {
+    if (x_roundtrips) {
+        fprintf(stderr, "slimterm: frame made %lu round trips in %lu requests\n",
+                x_roundtrips, NextRequest(xw.dpy) - x_frame_request);
+    }
+    x_roundtrips = 0;
+    x_frame_request = NextRequest(xw.dpy);
+}
+
+/* Allocate palette entry i, replacing the color it had; -1 if the name
+ * is not a color */
+static int xloadcolor(int i, const char *name) {
+    XftColor color;
+
+    if (!XftColorAllocName(xw.dpy, xw.visual, xw.colormap, name, &color)) return -1;
+    if (xw.fills[i]) {
+        XRenderFreePicture(xw.dpy, xw.fills[i]);
+        XftColorFree(xw.dpy, xw.visual, xw.colormap, &xw.colors[i]);
+    }
+    xw.colors[i] = color;
+    xw.fills[i] = XRenderCreateSolidFill(xw.dpy, &color.color);
+    if (i == (int)defaultbg) {
+        /* The window background, premultiplied by BACKGROUND_ALPHA */
+        xw.bg = color;
+        xw.bg.color.red *= BACKGROUND_ALPHA;
+        xw.bg.color.green *= BACKGROUND_ALPHA;
+        xw.bg.color.blue *= BACKGROUND_ALPHA;
+        xw.bg.color.alpha *= BACKGROUND_ALPHA;
+    }
+    return 0;
+}
+
+#ifdef XINPUT2
+/* Find the vertical scroll valuators of the pointers, with their
+ * current values */
+static void xinputaxes(void) {
+    int n;
+    XIDeviceInfo *info = XIQueryDevice(xw.dpy, XIAllMasterDevices, &n);
+
+    xw.nscroll_axes = 0;
+    for (int i = 0; i < n; i++) {
+        for (int c = 0; c < info[i].num_classes; c++) {
+            XIScrollClassInfo *sc = (XIScrollClassInfo *)info[i].classes[c];
+            if (sc->type != XIScrollClass || sc->scroll_type != XIScrollTypeVertical || !sc->increment) continue;
+            if (xw.nscroll_axes == MAX_SCROLL_AXES) break;
+            ScrollAxis *a = &xw.scroll_axes[xw.nscroll_axes++];
+            *a = (ScrollAxis){info[i].deviceid, sc->number, sc->increment, 0};
+            for (int v = 0; v < info[i].num_classes; v++) {
+                XIValuatorClassInfo *vc = (XIValuatorClassInfo *)info[i].classes[v];
+                if (vc->type == XIValuatorClass && vc->number == sc->number) a->last = vc->value;
+            }
+        }
+    }
+    XIFreeDeviceInfo(info);
+}
+
+/* Select XInput2 pointer events, which smooth scrolling comes in as
+ * changes of a scroll valuator */
+static void xinputinit(void) {
+    unsigned char bits[XIMaskLen(XI_LASTEVENT)] = {0};
+    XIEventMask mask = {XIAllMasterDevices, sizeof(bits), bits};
+    int event, error, major = 2, minor = 1;
+
+    if (!XQueryExtension(xw.dpy, "XInputExtension", &xw.xi, &event, &error) ||
+        XIQueryVersion(xw.dpy, &major, &minor) != Success || major < 2 || (major == 2 && minor < 1)) {
+        xw.xi = 0;
+        return;
+    }
+    XISetMask(bits, XI_Motion);
+    XISetMask(bits, XI_DeviceChanged);
+    XISelectEvents(xw.dpy, xw.win, &mask, 1);
+    xinputaxes();
+}
+
+#endif
+
 /* Initialize X11 window */
 void xinit(void) {
-    xw.border = BORDER_WIDTH;
     xw.col = DEFAULT_COLS;
     xw.row = DEFAULT_ROWS;
 
     xw.dpy = XOpenDisplay(NULL);
     if (!xw.dpy) die("XOpenDisplay failed");
+    if (debug_x) XSetAfterFunction(xw.dpy, xafter);
+
+#ifdef XCB
+    /* Xlib keeps the connection for Xft; events are read through XCB */
+    xw.xc = XGetXCBConnection(xw.dpy);
+    XSetEventQueueOwner(xw.dpy, XCBOwnsEventQueue);
+
+    /* Send every atom request before waiting for the first reply */
+    xcb_intern_atom_cookie_t cookies[ATOM_LAST];
+    for (int i = 0; i < ATOM_LAST; i++) {
+        cookies[i] = xcb_intern_atom(xw.xc, 0, strlen(atom_names[i]), atom_names[i]);
+    }
+    for (int i = 0; i < ATOM_LAST; i++) {
+        xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(xw.xc, cookies[i], NULL);
+        if (!reply) die("xcb_intern_atom failed");
+        xw.atoms[i] = reply->atom;
+        free(reply);
+    }
+#else
+    /* One round trip for every atom */
+    if (!XInternAtoms(xw.dpy, atom_names, ATOM_LAST, False, xw.atoms)) die("XInternAtoms failed");
+#endif
 
     int screen = DefaultScreen(xw.dpy);
-    Visual *visual = DefaultVisual(xw.dpy, screen);
-    Colormap colormap = DefaultColormap(xw.dpy, screen);
+    Window root = RootWindow(xw.dpy, screen);
+    XVisualInfo vi;
 
-    /* Load font */
-    xw.font = XftFontOpenName(xw.dpy, screen, FONT_NAME);
-    if (!xw.font) die("XftFontOpenName failed");
+    /* A translucent background needs a visual with an alpha channel */
+    if (BACKGROUND_ALPHA < 1 && XMatchVisualInfo(xw.dpy, screen, 32, TrueColor, &vi)) {
+        xw.visual = vi.visual;
+        xw.depth = vi.depth;
+        xw.colormap = XCreateColormap(xw.dpy, root, xw.visual, AllocNone);
+    } else {
+        xw.visual = DefaultVisual(xw.dpy, screen);
+        xw.depth = DefaultDepth(xw.dpy, screen);
+        xw.colormap = DefaultColormap(xw.dpy, screen);
+    }
 
-    /* Get font dimensions */
-    XGlyphInfo extents;
-    XftTextExtentsUtf8(xw.dpy, xw.font, (FcChar8 *)"M", 1, &extents);
-    xw.font_width = extents.xOff;
-    xw.font_height = xw.font->ascent + xw.font->descent;
+    /* Load font, scaled like the border to the screen's DPI */
+    xw.dpi = xdpi();
+    xw.border = xborder();
+    if (font_load(font_name) < 0) die("XftFontOpenName failed");
 
-    /* Create window */
-    Window root = RootWindow(xw.dpy, screen);
-    xw.win = XCreateSimpleWindow(xw.dpy, root, 0, 0, 100, 100, 0,
-                                 BlackPixel(xw.dpy, screen), BlackPixel(xw.dpy, screen));
+    /* Create window, with a colormap of its own in case the visual is
+     * not the root's */
+#ifdef XCB
+    uint32_t values[] = {0, 0, XEVENT_MASK, xw.colormap};
+    xw.win = xcb_generate_id(xw.xc);
+    xcb_create_window(xw.xc, xw.depth, xw.win, root, 0, 0, 100, 100, 0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT, XVisualIDFromVisual(xw.visual),
+                      XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_EVENT_MASK | XCB_CW_COLORMAP, values);
+#else
+    XSetWindowAttributes attrs = {.background_pixel = 0, .border_pixel = 0, .colormap = xw.colormap};
+    xw.win = XCreateWindow(xw.dpy, root, 0, 0, 100, 100, 0, xw.depth, InputOutput, xw.visual,
+                           CWBackPixel | CWBorderPixel | CWColormap, &attrs);
+#endif
 
     /* Create pixmap for double-buffering */
     xw.w = xw.col * xw.font_width + 2 * xw.border;
     xw.h = xw.row * xw.font_height + 2 * xw.border;
-    xw.pixmap = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h, DefaultDepth(xw.dpy, screen));
+    xw.pixmap = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h, xw.depth);
+
+    /* The default GC has the root's depth, which the pixmap may not */
+    xw.gc = XCreateGC(xw.dpy, xw.pixmap, 0, NULL);
 
     /* Create Xft draw context */
-    xw.draw = XftDrawCreate(xw.dpy, xw.pixmap, visual, colormap);
+    xw.draw = XftDrawCreate(xw.dpy, xw.pixmap, xw.visual, xw.colormap);
     if (!xw.draw) die("XftDrawCreate failed");
 
     /* Load colors */
     for (int i = 0; i < 16; i++) {
-        if (!XftColorAllocName(xw.dpy, visual, colormap, colors[i], &xw.colors[i])) {
-            die("XftColorAllocName failed for color %d", i);
-        }
+        if (xloadcolor(i, color_names[i]) < 0) die("XftColorAllocName failed for color %d", i);
     }
 
     /* Set window size based on font and terminal dimensions */
     XResizeWindow(xw.dpy, xw.win, xw.w, xw.h);
 
-    XSelectInput(xw.dpy, xw.win, ExposureMask | KeyPressMask | StructureNotifyMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask);
+    /* Key repeats arrive as presses without releases in between */
+    XkbSetDetectableAutoRepeat(xw.dpy, True, NULL);
+
+#ifdef XINPUT2
+    xinputinit();
+#endif
+
+    /* Resource changes, such as a new Xft.dpi */
+    XSelectInput(xw.dpy, root, PropertyChangeMask);
+
+#ifndef XCB
+    XSelectInput(xw.dpy, xw.win, XEVENT_MASK);
+
+    /* Input method, now or whenever one is started */
+    if (XSetLocaleModifiers("") == NULL) fprintf(stderr, "slimterm: XSetLocaleModifiers failed\n");
+    if (!ximopen(xw.dpy)) {
+        XRegisterIMInstantiateCallback(xw.dpy, NULL, NULL, NULL, ximinstantiate, NULL);
+    }
+#endif
+#ifdef PRESENT
+    xpresentinit();
+#endif
     XMapWindow(xw.dpy, xw.win);
     XFlush(xw.dpy);
-
-    term_init();
 }
 
 
-/* Draw the terminal buffer */
-void xdraw(void) {
-    /* Clear the pixmap (background) */
-    XftDrawRect(xw.draw, &xw.colors[defaultbg], 0, 0, xw.w, xw.h);
+/* Upload an image to the X server the first time it is shown. The
+ * client-side pixels are dropped afterwards; the server copy is what
+ * every later frame composites from. */
+static int image_upload(Image *img) {
+    if (img->picture) return 1;
+    if (!img->pixels) return 0;
+
+    /* The pixels are in the picture's format, which need not be the
+     * window's visual: the image takes its channel masks from it */
+    XRenderPictFormat *fmt = XRenderFindStandardFormat(xw.dpy, PictStandardARGB32);
+    img->pixmap = XCreatePixmap(xw.dpy, xw.win, img->width, img->height, 32);
+    XImage *ximg = XCreateImage(xw.dpy, NULL, 32, ZPixmap, 0, (char *)img->pixels, img->width, img->height, 32, 0);
+    uint32_t endian = 1;
+    ximg->byte_order = *(unsigned char *)&endian ? LSBFirst : MSBFirst;
+    ximg->red_mask = (unsigned long)fmt->direct.redMask << fmt->direct.red;
+    ximg->green_mask = (unsigned long)fmt->direct.greenMask << fmt->direct.green;
+    ximg->blue_mask = (unsigned long)fmt->direct.blueMask << fmt->direct.blue;
+    GC gc = XCreateGC(xw.dpy, img->pixmap, 0, NULL);
+    XPutImage(xw.dpy, img->pixmap, gc, ximg, 0, 0, 0, 0, img->width, img->height);
+    XFreeGC(xw.dpy, gc);
+    ximg->data = NULL;
+    XDestroyImage(ximg);
+    img->picture = XRenderCreatePicture(xw.dpy, img->pixmap, fmt, 0, NULL);
+    free(img->pixels);
+    img->pixels = NULL;
+    return 1;
+}
+
+/* Box drawing. Lines of U+2500-257F are described by their arms, two
+ * bits each (none, light, heavy, double) for up, right, down and left.
+ * Dashed lines are drawn solid; rounded corners (U+256D-2570) and
+ * diagonals are left to the font. */
+#define BOX(u, r, d, l) ((u) | (r) << 2 | (d) << 4 | (l) << 6)
+
+static const unsigned char box_lines[128] = {
+    BOX(0,1,0,1), BOX(0,2,0,2), BOX(1,0,1,0), BOX(2,0,2,0), BOX(0,1,0,1), BOX(0,2,0,2), BOX(1,0,1,0), BOX(2,0,2,0),
+    BOX(0,1,0,1), BOX(0,2,0,2), BOX(1,0,1,0), BOX(2,0,2,0), BOX(0,1,1,0), BOX(0,2,1,0), BOX(0,1,2,0), BOX(0,2,2,0),
+    BOX(0,0,1,1), BOX(0,0,1,2), BOX(0,0,2,1), BOX(0,0,2,2), BOX(1,1,0,0), BOX(1,2,0,0), BOX(2,1,0,0), BOX(2,2,0,0),
+    BOX(1,0,0,1), BOX(1,0,0,2), BOX(2,0,0,1), BOX(2,0,0,2), BOX(1,1,1,0), BOX(1,2,1,0), BOX(2,1,1,0), BOX(1,1,2,0),
+    BOX(2,1,2,0), BOX(2,2,1,0), BOX(1,2,2,0), BOX(2,2,2,0), BOX(1,0,1,1), BOX(1,0,1,2), BOX(2,0,1,1), BOX(1,0,2,1),
+    BOX(2,0,2,1), BOX(2,0,1,2), BOX(1,0,2,2), BOX(2,0,2,2), BOX(0,1,1,1), BOX(0,1,1,2), BOX(0,2,1,1), BOX(0,2,1,2),
+    BOX(0,1,2,1), BOX(0,1,2,2), BOX(0,2,2,1), BOX(0,2,2,2), BOX(1,1,0,1), BOX(1,1,0,2), BOX(1,2,0,1), BOX(1,2,0,2),
+    BOX(2,1,0,1), BOX(2,1,0,2), BOX(2,2,0,1), BOX(2,2,0,2), BOX(1,1,1,1), BOX(1,1,1,2), BOX(1,2,1,1), BOX(1,2,1,2),
+    BOX(2,1,1,1), BOX(1,1,2,1), BOX(2,1,2,1), BOX(2,1,1,2), BOX(2,2,1,1), BOX(1,1,2,2), BOX(1,2,2,1), BOX(2,2,1,2),
+    BOX(1,2,2,2), BOX(2,1,2,2), BOX(2,2,2,1), BOX(2,2,2,2), BOX(0,1,0,1), BOX(0,2,0,2), BOX(1,0,1,0), BOX(2,0,2,0),
+    BOX(0,3,0,3), BOX(3,0,3,0), BOX(0,3,1,0), BOX(0,1,3,0), BOX(0,3,3,0), BOX(0,0,1,3), BOX(0,0,3,1), BOX(0,0,3,3),
+    BOX(1,3,0,0), BOX(3,1,0,0), BOX(3,3,0,0), BOX(1,0,0,3), BOX(3,0,0,1), BOX(3,0,0,3), BOX(1,3,1,0), BOX(3,1,3,0),
+    BOX(3,3,3,0), BOX(1,0,1,3), BOX(3,0,3,1), BOX(3,0,3,3), BOX(0,3,1,3), BOX(0,1,3,1), BOX(0,3,3,3), BOX(1,3,0,3),
+    BOX(3,1,0,1), BOX(3,3,0,3), BOX(1,3,1,3), BOX(3,1,3,1), BOX(3,3,3,3), 0, 0, 0,
+    0, 0, 0, 0, BOX(0,0,0,1), BOX(1,0,0,0), BOX(0,1,0,0), BOX(0,0,1,0),
+    BOX(0,0,0,2), BOX(2,0,0,0), BOX(0,2,0,0), BOX(0,0,2,0), BOX(0,2,0,1), BOX(1,0,2,0), BOX(0,1,0,2), BOX(2,0,1,0),
+};
+
+/* Quadrants of U+2596-259F: upper left, upper right, lower left, lower right */
+static const unsigned char box_quadrants[10] = {4, 8, 1, 13, 9, 7, 11, 2, 6, 14};
+
+/* Slot of a character in the box mask atlas, -1 if it is drawn from
+ * the font: lines and blocks, the DEC scan lines and the two solid
+ * powerline arrows */
+static int box_slot(uint32_t rune) {
+    if (rune >= 0x2500 && rune <= 0x259f) return rune < 0x2580 && !box_lines[rune - 0x2500] ? -1 : (int)(rune - 0x2500);
+    if (rune >= 0x23ba && rune <= 0x23bd) return 160 + rune - 0x23ba;
+    if (rune == 0xe0b0 || rune == 0xe0b2) return 164 + (rune - 0xe0b0) / 2;
+    return -1;
+}
+
+/* Fill a rectangle of a slot's mask with coverage alpha */
+static void box_fill(int slot, int x, int y, int w, int h, unsigned short alpha) {
+    XRenderColor c = {0, 0, 0, alpha};
+    if (w > 0 && h > 0) XRenderFillRectangle(xw.dpy, PictOpSrc, xw.fontset->box_mask, &c, slot * xw.font_width + x, y, w, h);
+}
+
+/* Draw the arms of a line character. Each arm runs from its edge of the
+ * cell across the lines perpendicular to it, so joints are closed. */
+static void box_render_lines(int slot, unsigned char arms) {
+    int w = xw.font_width, h = xw.font_height;
+    int lw = MAX(1, w / 8);
+    int width[4] = {0, lw, 2 * lw, 3 * lw}; /* Light, heavy, double */
+    int up = arms & 3, right = arms >> 2 & 3, down = arms >> 4 & 3, left = arms >> 6 & 3;
+    int vt = MAX(width[up], width[down]), ht = MAX(width[left], width[right]);
+
+    for (int i = 0; i < 4; i++) {
+        int kind = arms >> (2 * i) & 3;
+        if (!kind) continue;
+        int t = width[kind];
+        int vertical = !(i & 1);
+        int size = vertical ? w : h, len = vertical ? h : w;
+        int ext = vertical ? ht : vt; /* Across the perpendicular lines */
+        int start = (i == 0 || i == 3) ? 0 : (len - ext) / 2;
+        int end = (i == 0 || i == 3) ? (len - ext) / 2 + ext : len;
+        for (int line = 0; line < (kind == 3 ? 2 : 1); line++) {
+            int off = (size - t) / 2 + line * 2 * lw;
+            int thick = kind == 3 ? lw : t;
+            int from = start, to = end;
+            /* The inner line of a double corner stops at the other inner line */
+            int faces = line ? (vertical ? right : down) : (vertical ? left : up);
+            if (kind == 3 && faces == 3) {
+                if (i == 1 || i == 2) from += 2 * lw;
+                else to -= 2 * lw;
+            }
+            if (vertical) box_fill(slot, off, from, thick, to - from, 0xffff);
+            else box_fill(slot, from, off, to - from, thick, 0xffff);
+        }
+    }
+}
+
+/* Render one character into its slot of the atlas */
+static void box_render(int slot, uint32_t rune) {
+    int w = xw.font_width, h = xw.font_height;
+
+    xw.fontset->box_done[slot] = 1;
+    if (rune >= 0x23ba && rune <= 0x23bd) { /* Scan lines 1, 3, 7 and 9 */
+        static const int scan[4] = {0, 2, 6, 8};
+        int lw = MAX(1, w / 8);
+        box_fill(slot, 0, scan[rune - 0x23ba] * (h - lw) / 8, w, lw, 0xffff);
+    } else if (rune >= 0xe000) { /* Powerline arrows */
+        double x0 = slot * w, right = rune == 0xe0b0;
+        XTriangle tri = {
+            {XDoubleToFixed(x0 + (right ? 0 : w)), XDoubleToFixed(0)},
+            {XDoubleToFixed(x0 + (right ? w : 0)), XDoubleToFixed(h / 2.0)},
+            {XDoubleToFixed(x0 + (right ? 0 : w)), XDoubleToFixed(h)},
+        };
+        XRenderCompositeTriangles(xw.dpy, PictOpOver, xw.fills[defaultfg], xw.fontset->box_mask,
+                                  XRenderFindStandardFormat(xw.dpy, PictStandardA8), 0, 0, &tri, 1);
+    } else if (rune < 0x2580) {
+        box_render_lines(slot, box_lines[rune - 0x2500]);
+    } else if (rune == 0x2580) { /* Upper half */
+        box_fill(slot, 0, 0, w, h / 2, 0xffff);
+    } else if (rune <= 0x2588) { /* Lower eighths up to full */
+        int n = h * (rune - 0x2580) / 8;
+        box_fill(slot, 0, h - n, w, n, 0xffff);
+    } else if (rune <= 0x258f) { /* Left eighths */
+        box_fill(slot, 0, 0, w * (0x2590 - rune) / 8, h, 0xffff);
+    } else if (rune == 0x2590) { /* Right half */
+        box_fill(slot, w / 2, 0, w - w / 2, h, 0xffff);
+    } else if (rune <= 0x2593) { /* Shades */
+        box_fill(slot, 0, 0, w, h, 0x4000 * (rune - 0x2590));
+    } else if (rune == 0x2594) { /* Upper eighth */
+        box_fill(slot, 0, 0, w, MAX(h / 8, 1), 0xffff);
+    } else if (rune == 0x2595) { /* Right eighth */
+        box_fill(slot, w - MAX(w / 8, 1), 0, MAX(w / 8, 1), h, 0xffff);
+    } else { /* Quadrants */
+        int q = box_quadrants[rune - 0x2596];
+        if (q & 1) box_fill(slot, 0, 0, w / 2, h / 2, 0xffff);
+        if (q & 2) box_fill(slot, w / 2, 0, w - w / 2, h / 2, 0xffff);
+        if (q & 4) box_fill(slot, 0, h / 2, w / 2, h - h / 2, 0xffff);
+        if (q & 8) box_fill(slot, w / 2, h / 2, w - w / 2, h - h / 2, 0xffff);
+    }
+}
+
+/* Create the current font set's atlas, empty */
+static void box_atlas(void) {
+    FontSet *fs = xw.fontset;
+    XRenderColor clear = {0, 0, 0, 0};
+
+    fs->box_pixmap = XCreatePixmap(xw.dpy, xw.win, xw.font_width * BOX_SLOTS, xw.font_height, 8);
+    fs->box_mask = XRenderCreatePicture(xw.dpy, fs->box_pixmap,
+                                        XRenderFindStandardFormat(xw.dpy, PictStandardA8), 0, NULL);
+    XRenderFillRectangle(xw.dpy, PictOpSrc, fs->box_mask, &clear, 0, 0, xw.font_width * BOX_SLOTS,
+                         xw.font_height);
+}
+
+/* Draw a box-drawing character from its mask, rendered once per font
+ * set; returns 0 for characters that come from the font */
+static int xdrawbox(uint32_t rune, int color, int x, int y) {
+    int slot = box_slot(rune);
+
+    if (slot < 0) return 0;
+    if (!xw.fontset->box_mask) box_atlas();
+    if (!xw.fontset->box_done[slot]) box_render(slot, rune);
+    XRenderComposite(xw.dpy, PictOpOver, xw.fills[color], xw.fontset->box_mask, XftDrawPicture(xw.draw),
+                     0, 0, slot * xw.font_width, 0, x, y, xw.font_width, xw.font_height);
+    return 1;
+}
+
+/* Composite the image tiles in view at pixel offset (ox, oy); top is
+ * the first line shown. Tiles are cut at the right edge of the pane. */
+static void xdrawimages(Term *term, int top, int ox, int oy) {
+    Picture dst = XftDrawPicture(xw.draw);
+
+    for (int i = 0; i < term->ntiles; i++) {
+        ImageTile *t = &term->tiles[i];
+        if (t->alt != term->use_alt_buffer || t->col >= term->cols) continue;
+        long long r = term->scrollback_len + tile_row(term, t) - top;
+        if (t->alt) r = tile_row(term, t);
+        if (r < 0 || r >= term->rows || !image_upload(t->img)) continue;
+        t->img->used = ++image_tick;
+        int w = MIN(t->src_w, (term->cols - t->col) * xw.font_width);
+        XRenderComposite(xw.dpy, PictOpOver, t->img->picture, None, dst,
+                         t->src_x, t->src_y, 0, 0, ox + t->col * xw.font_width,
+                         oy + r * xw.font_height, w, t->src_h);
+    }
+}
+
+/* Draw the tab bar: one label per tab, the current one highlighted */
+static void xdrawtabs(void) {
+    int x = xw.border, y = xw.border + xw.font_height - xw.font->descent;
+    char label[16];
+
+    for (int i = 0; i < ntabs; i++) {
+        int n = snprintf(label, sizeof(label), " %d ", i + 1);
+        int w = n * xw.font_width;
+        if (x + w > xw.w - xw.border) break;
+        XftDrawRect(xw.draw, i == curtab ? &xw.colors[selection_bg] : &xw.bg,
+                    x, xw.border, w, xw.font_height);
+        XftDrawStringUtf8(xw.draw, &xw.colors[i == curtab ? selection_fg : defaultfg], xw.font,
+                          x, y, (FcChar8 *)label, n);
+        x += w;
+    }
+}
+
+/* The row and column of the focused pane under a pointer position,
+ * kept inside the pane */
+static int pane_row(Term *term, int y) {
+    return MAX(MIN((y - xw.border - term->scroll_frac) / xw.font_height - term->y, term->rows - 1), 0);
+}
+
+static int pane_col(Term *term, int x) {
+    return MAX(MIN((x - xw.border) / xw.font_width - term->x, term->cols - 1), 0);
+}
+
+/* Focus the pane under a click */
+static void pane_click(int x, int y) {
+    Tab *tab = &tabs[curtab];
+    int col = (x - xw.border) / xw.font_width, row = (y - xw.border) / xw.font_height;
+
+    for (int p = 0; p < tab->npanes; p++) {
+        Term *t = tab->panes[p];
+        if (col < t->x || col >= t->x + t->cols || row < t->y || row >= t->y + t->rows) continue;
+        if (p != tab->focus) tab_focus(p - tab->focus);
+        return;
+    }
+}
+
+/* Draw the count of lines output below a view into the history, at the
+ * right end of the pane's bottom row */
+static void xdrawbadge(Term *term, int ox, int oy) {
+    char label[32];
+    int n = snprintf(label, sizeof(label), " %d new line%s ", term->new_lines, term->new_lines == 1 ? "" : "s");
+    int w = n * xw.font_width;
+    if (w > term->cols * xw.font_width) return;
+
+    int x = ox + term->cols * xw.font_width - w, y = oy + (term->rows - 1) * xw.font_height;
+    XftDrawRect(xw.draw, &xw.colors[selection_bg], x, y, w, xw.font_height);
+    XftDrawStringUtf8(xw.draw, &xw.colors[selection_fg], xw.font, x, y + xw.font->ascent, (FcChar8 *)label, n);
+}
+
+/* Draw a terminal's buffer at the pixel offset of its pane, only the
+ * rows in the band from y0 to y1 pixels below its top */
+static void xdrawterm(Term *term, int ox, int oy, int y0, int y1) {
+    int h = term->rows * xw.font_height;
+    int clipped = y0 > 0 || y1 < h || term->scroll_frac;
 
     /* Determine selection boundaries */
     int sel_start_row = -1, sel_end_row = -1, sel_start_col = -1, sel_end_col = -1;
-    if (term.sel_start_row != -1 && term.sel_end_row != -1) {
-        sel_start_row = MIN(term.sel_start_row, term.sel_end_row);
-        sel_end_row = MAX(term.sel_start_row, term.sel_end_row);
-        sel_start_col = term.sel_start_row < term.sel_end_row ? term.sel_start_col : term.sel_end_col;
-        sel_end_col = term.sel_start_row < term.sel_end_row ? term.sel_end_col : term.sel_start_col;
-    }
-
-    /* Draw scrollback and current buffer */
-    int start_row = term.scroll_offset;
-    int display_rows = MIN(xw.row, term.scrollback_len + xw.row);
-    for (int r = 0; r < display_rows; r++) {
-        int x = xw.border;
-        int y = xw.border + (r + 1) * xw.font_height - xw.font->descent;
+    if (term->sel_start_row != -1 && term->sel_end_row != -1) {
+        sel_start_row = MIN(term->sel_start_row, term->sel_end_row);
+        sel_end_row = MAX(term->sel_start_row, term->sel_end_row);
+        sel_start_col = term->sel_start_row < term->sel_end_row ? term->sel_start_col : term->sel_end_col;
+        sel_end_col = term->sel_start_row < term->sel_end_row ? term->sel_end_col : term->sel_start_col;
+    }
+
+    if (clipped) {
+        /* Keep partial rows inside the band */
+        XRectangle clip = {ox, oy + y0, term->cols * xw.font_width, y1 - y0};
+        XftDrawSetClipRectangles(xw.draw, 0, 0, &clip, 1);
+    }
+
+    /* Draw scrollback and current buffer. Lines are numbered oldest
+     * scrollback line first, so the view starts scroll_offset lines
+     * above the screen, and scroll_frac pixels lower to show part of
+     * the line above it. */
+    int top = term->scrollback_len + term->scroll_offset;
+    oy += term->scroll_frac;
+    for (int r = term->scroll_frac ? -1 : 0; r < term->rows; r++) {
+        int x = ox;
+        int y = oy + (r + 1) * xw.font_height - xw.font->descent;
+        if (term->scroll_frac + (r + 1) * xw.font_height <= y0 || term->scroll_frac + r * xw.font_height >= y1) {
+            continue;
+        }
         int src_row;
         char *data;
         int *fg, *bg;
 
-        if (r + start_row < term.scrollback_len) {
+        if (top + r < term->scrollback_len) {
             /* Draw from scrollback */
-            src_row = (term.scrollback_pos - term.scrollback_len + r + start_row + SCROLLBACK_SIZE) % SCROLLBACK_SIZE;
-            data = term.scrollback[src_row];
-            fg = term.scrollback_fg[src_row];
-            bg = term.scrollback_bg[src_row];
+            src_row = scrollback_row(term, top + r);
+            data = term->scrollback[src_row];
+            fg = term->scrollback_fg[src_row];
+            bg = term->scrollback_bg[src_row];
         } else {
             /* Draw from current buffer */
-            src_row = r + start_row - term.scrollback_len;
-            if (src_row >= xw.row) break;
-            data = term.use_alt_buffer ? term.alt_data[src_row] : term.data[src_row];
-            fg = term.use_alt_buffer ? term.alt_fg[src_row] : term.fg[src_row];
-            bg = term.use_alt_buffer ? term.alt_bg[src_row] : term.bg[src_row];
-        }
-
-        int actual_row = r + start_row - term.scrollback_len;
-        int is_selected_row = (actual_row >= sel_start_row && actual_row <= sel_end_row);
-
-        for (int c = 0; c < xw.col; c++) {
-            int is_selected = 0;
-            if (is_selected_row) {
-                if (actual_row == sel_start_row && actual_row == sel_end_row) {
-                    is_selected = (c >= sel_start_col && c <= sel_end_col);
-                } else if (actual_row == sel_start_row) {
-                    is_selected = (c >= sel_start_col);
-                } else if (actual_row == sel_end_row) {
-                    is_selected = (c <= sel_end_col);
-                } else {
-                    is_selected = 1;
-                }
+            src_row = top + r - term->scrollback_len;
+            if (src_row >= term->rows) break;
+            data = term->use_alt_buffer ? term->alt_data[src_row] : term->data[src_row];
+            fg = term->use_alt_buffer ? term->alt_fg[src_row] : term->fg[src_row];
+            bg = term->use_alt_buffer ? term->alt_bg[src_row] : term->bg[src_row];
+        }
+
+        /* Columns of this row inside the selection */
+        int sel_first = 1, sel_last = 0;
+        if (top + r >= sel_start_row && top + r <= sel_end_row) {
+            sel_first = top + r == sel_start_row ? sel_start_col : 0;
+            sel_last = top + r == sel_end_row ? sel_end_col : term->cols - 1;
+        }
+
+        /* Backgrounds first, one rectangle per run of a color. Cells on
+         * the default background show the window's fill, which is what
+         * lets it be translucent. */
+        for (int c = 0, run_bg = -1, run_start = 0; c <= term->cols; c++) {
+            int color = -1;
+            if (c == term->cols) color = -2; /* Ends the last run */
+            else if (c >= sel_first && c <= sel_last) color = selection_bg;
+            else if (bg[c] % 16 != (int)defaultbg) color = bg[c] % 16;
+            if (color == run_bg) continue;
+            if (run_bg >= 0) {
+                XftDrawRect(xw.draw, &xw.colors[run_bg], ox + run_start * xw.font_width, y - xw.font->ascent,
+                            (c - run_start) * xw.font_width, xw.font_height);
             }
+            run_bg = color;
+            run_start = c;
+        }
+
+        for (int c = 0; c < term->cols; c++) {
+            int is_selected = c >= sel_first && c <= sel_last;
 
-            /* Draw background */
-            XftDrawRect(xw.draw, &xw.colors[is_selected ? selection_bg : (bg[c] % 16)],
-                        x, y - xw.font->ascent, xw.font_width, xw.font_height);
             if (data[c]) {
                 /* Draw character */
-                char ch[2] = {data[c], 0};
-                XftDrawStringUtf8(xw.draw, &xw.colors[is_selected ? selection_fg : (fg[c] % 16)], xw.font,
-                                  x, y, (FcChar8 *)ch, 1);
+                FcChar32 ch = cell_rune(data[c]);
+                int color = is_selected ? selection_fg : (fg[c] % 16);
+                if (!xdrawbox(ch, color, x, y - xw.font->ascent)) {
+                    XftDrawString32(xw.draw, &xw.colors[color], xw.font, x, y, &ch, 1);
+                }
             }
             x += xw.font_width;
         }
     }
 
+    xdrawimages(term, top, ox, oy);
+    if (term->new_lines && y1 > h - xw.font_height) xdrawbadge(term, ox, oy - term->scroll_frac);
+    if (clipped) XftDrawSetClip(xw.draw, None);
+}
+
+/* Show the pixmap in the window */
+static void xshow(void) {
+#ifdef PRESENT
+    if (xw.present) {
+        /* Show the frame at the next vertical blank */
+        XPresentPixmap(xw.dpy, xw.win, xw.pixmap, ++xw.present_serial, None, None, 0, 0,
+                       None, None, None, PresentOptionNone, xw.present_msc + 1, 0, 0, NULL, 0);
+        xw.present_pending = PRESENT_COMPLETE | PRESENT_IDLE;
+    } else
+#endif
     /* Copy the pixmap to the window */
-    XCopyArea(xw.dpy, xw.pixmap, xw.win, DefaultGC(xw.dpy, DefaultScreen(xw.dpy)), 0, 0, xw.w, xw.h, 0, 0);
+    XCopyArea(xw.dpy, xw.pixmap, xw.win, xw.gc, 0, 0, xw.w, xw.h, 0, 0);
     XFlush(xw.dpy);
 }
 
-/* Handle X11 events */
-void xevent(void) {
-    XEvent ev;
-    while (XPending(xw.dpy)) {
-        XNextEvent(xw.dpy, &ev);
-        switch (ev.type) {
-        case Expose:
-            xdraw();
-            break;
-        case ConfigureNotify:
-            {
-                XConfigureEvent *cev = &ev.xconfigure;
-                int new_cols = (cev->width - 2 * xw.border) / xw.font_width;
-                int new_rows = (cev->height - 2 * xw.border) / xw.font_height;
-                if (new_cols != xw.col || new_rows != xw.row) {
-                    ttyresize(new_cols, new_rows);
-                    xdraw();
-                }
+/* Draw the current tab: the tab bar, every pane and the lines between
+ * them. Terminals in other tabs are not drawn. */
+void xdraw(void) {
+    Tab *tab = &tabs[curtab];
+    Term *term = term_focused();
+
+#ifdef PRESENT
+    /* The server may still be reading the pixmap; draw once it is done */
+    if (xw.present_pending) {
+        dirty = 1;
+        return;
+    }
+#endif
+    /* Clear the pixmap (background) */
+    XftDrawRect(xw.draw, &xw.bg, 0, 0, xw.w, xw.h);
+
+    if (ntabs > 1) xdrawtabs();
+    for (int p = 0; p < tab->npanes; p++) {
+        Term *t = tab->panes[p];
+        int ox = xw.border + t->x * xw.font_width, oy = xw.border + t->y * xw.font_height;
+        xdrawterm(t, ox, oy, 0, t->rows * xw.font_height);
+        if (p == 0) continue;
+        /* Separator before this pane, centred in the cell between */
+        if (tab->stacked) {
+            XftDrawRect(xw.draw, &xw.colors[defaultfg], ox, oy - xw.font_height / 2 - 1,
+                        t->cols * xw.font_width, 1);
+        } else {
+            XftDrawRect(xw.draw, &xw.colors[defaultfg], ox - xw.font_width / 2 - 1, oy,
+                        1, t->rows * xw.font_height);
+        }
+    }
+
+    xshow();
+    ximspot(term);
+    if (shm) shm_publish(term);
+}
+
+/* Draw again the bottom row of the panes with a count of new lines,
+ * which is all output changes while their views are in the history */
+static void xdrawbadges(void) {
+    Tab *tab = &tabs[curtab];
+    int fh = xw.font_height;
+
+    for (int p = 0; p < tab->npanes; p++) {
+        Term *t = tab->panes[p];
+        if (!t->new_lines) continue;
+        int ox = xw.border + t->x * xw.font_width, oy = xw.border + t->y * fh, h = t->rows * fh;
+        XftDrawRect(xw.draw, &xw.bg, ox, oy + h - fh, t->cols * xw.font_width, fh);
+        xdrawterm(t, ox, oy, h - fh, h);
+    }
+    xshow();
+    if (shm) shm_publish(term_focused());
+}
+
+/* Scroll a terminal's view by a number of pixels, positive into the
+ * history. When nothing else changed since the last frame, the pane is
+ * moved within the pixmap and only the rows it uncovers are drawn. */
+static void xscrollview(Term *term, int pixels) {
+    int fh = xw.font_height, h = term->rows * fh, w = term->cols * xw.font_width;
+    int before = -term->scroll_offset * fh + term->scroll_frac;
+    int pos = MAX(MIN(before + pixels, term->scrollback_len * fh), 0);
+    int delta = pos - before; /* How far the content moves down */
+    int ox = xw.border + term->x * xw.font_width, oy = xw.border + term->y * fh;
+    int badge = term->new_lines;
+
+    if (!delta) return;
+    term->scroll_offset = -(pos / fh);
+    term->scroll_frac = pos % fh;
+    if (!pos) term->new_lines = 0;
+    if (dirty || abs(delta) >= h || !tabs_visible(term)
+#ifdef PRESENT
+        || xw.present_pending
+#endif
+    ) {
+        xdraw();
+        return;
+    }
+
+    int y0 = delta > 0 ? 0 : h + delta, y1 = delta > 0 ? delta : h;
+    XCopyArea(xw.dpy, xw.pixmap, xw.pixmap, xw.gc, ox, oy + MAX(-delta, 0), w, h - abs(delta),
+              ox, oy + MAX(delta, 0));
+    /* The count of new lines was copied along; its row and the one it
+     * landed on are drawn again */
+    if (badge && delta < 0) y0 = MAX(y0 - fh, 0);
+    XftDrawRect(xw.draw, &xw.bg, ox, oy + y0, w, y1 - y0);
+    xdrawterm(term, ox, oy, y0, y1);
+    if (badge && delta > 0) {
+        XftDrawRect(xw.draw, &xw.bg, ox, oy + h - fh, w, fh);
+        xdrawterm(term, ox, oy, h - fh, h);
+    }
+    xshow();
+    if (shm && term == term_focused()) shm_publish(term);
+}
+
+/* Special keys, encoded as xterm does. type selects the sequence:
+ * KEY_CURSOR  CSI <final>, SS3 <final> in application cursor mode
+ * KEY_TILDE   CSI <code> ~
+ * KEY_SS3     SS3 <final>
+ * KEY_KEYPAD  <code> as a character, SS3 <appfinal> in application
+ *             keypad mode
+ * KEY_CHAR    <code> as a character, CSI u style with modifyOtherKeys
+ * Modifiers turn the first three into CSI 1;<mod><final> or
+ * CSI <code>;<mod>~. */
+enum { KEY_CURSOR, KEY_TILDE, KEY_SS3, KEY_KEYPAD, KEY_CHAR };
+
+static const struct {
+    KeySym keysym;
+    int type;
+    int code;
+    int appfinal;
+} keydefs[] = {
+    {XK_Up, KEY_CURSOR, 'A'}, {XK_Down, KEY_CURSOR, 'B'},
+    {XK_Right, KEY_CURSOR, 'C'}, {XK_Left, KEY_CURSOR, 'D'},
+    {XK_Home, KEY_CURSOR, 'H'}, {XK_End, KEY_CURSOR, 'F'},
+    {XK_Begin, KEY_CURSOR, 'E'},
+    {XK_KP_Up, KEY_CURSOR, 'A'}, {XK_KP_Down, KEY_CURSOR, 'B'},
+    {XK_KP_Right, KEY_CURSOR, 'C'}, {XK_KP_Left, KEY_CURSOR, 'D'},
+    {XK_KP_Home, KEY_CURSOR, 'H'}, {XK_KP_End, KEY_CURSOR, 'F'},
+    {XK_KP_Begin, KEY_CURSOR, 'E'},
+    {XK_Insert, KEY_TILDE, 2}, {XK_Delete, KEY_TILDE, 3},
+    {XK_Prior, KEY_TILDE, 5}, {XK_Next, KEY_TILDE, 6},
+    {XK_KP_Insert, KEY_TILDE, 2}, {XK_KP_Delete, KEY_TILDE, 3},
+    {XK_KP_Prior, KEY_TILDE, 5}, {XK_KP_Next, KEY_TILDE, 6},
+    {XK_F1, KEY_SS3, 'P'}, {XK_F2, KEY_SS3, 'Q'},
+    {XK_F3, KEY_SS3, 'R'}, {XK_F4, KEY_SS3, 'S'},
+    {XK_F5, KEY_TILDE, 15}, {XK_F6, KEY_TILDE, 17},
+    {XK_F7, KEY_TILDE, 18}, {XK_F8, KEY_TILDE, 19},
+    {XK_F9, KEY_TILDE, 20}, {XK_F10, KEY_TILDE, 21},
+    {XK_F11, KEY_TILDE, 23}, {XK_F12, KEY_TILDE, 24},
+    {XK_F13, KEY_TILDE, 25}, {XK_F14, KEY_TILDE, 26},
+    {XK_F15, KEY_TILDE, 28}, {XK_F16, KEY_TILDE, 29},
+    {XK_F17, KEY_TILDE, 31}, {XK_F18, KEY_TILDE, 32},
+    {XK_F19, KEY_TILDE, 33}, {XK_F20, KEY_TILDE, 34},
+    {XK_KP_0, KEY_KEYPAD, '0', 'p'}, {XK_KP_1, KEY_KEYPAD, '1', 'q'},
+    {XK_KP_2, KEY_KEYPAD, '2', 'r'}, {XK_KP_3, KEY_KEYPAD, '3', 's'},
+    {XK_KP_4, KEY_KEYPAD, '4', 't'}, {XK_KP_5, KEY_KEYPAD, '5', 'u'},
+    {XK_KP_6, KEY_KEYPAD, '6', 'v'}, {XK_KP_7, KEY_KEYPAD, '7', 'w'},
+    {XK_KP_8, KEY_KEYPAD, '8', 'x'}, {XK_KP_9, KEY_KEYPAD, '9', 'y'},
+    {XK_KP_Multiply, KEY_KEYPAD, '*', 'j'}, {XK_KP_Add, KEY_KEYPAD, '+', 'k'},
+    {XK_KP_Separator, KEY_KEYPAD, ',', 'l'}, {XK_KP_Subtract, KEY_KEYPAD, '-', 'm'},
+    {XK_KP_Decimal, KEY_KEYPAD, '.', 'n'}, {XK_KP_Divide, KEY_KEYPAD, '/', 'o'},
+    {XK_KP_Equal, KEY_KEYPAD, '=', 'X'}, {XK_KP_Enter, KEY_KEYPAD, '\r', 'M'},
+    {XK_BackSpace, KEY_CHAR, 0x7f}, {XK_Tab, KEY_CHAR, '\t'},
+    {XK_Return, KEY_CHAR, '\r'}, {XK_Escape, KEY_CHAR, 0x1b},
+};
+
+/* Terminal modes that change what keys send */
+#define KEYMODE_APPCURSOR 1
+#define KEYMODE_APPKEYPAD 2
+#define KEYMODE_MODOTHER 4
+
+/* keytab[keysym & 0xff][modifiers][mode] is the offset of the sequence
+ * sent for a keysym in the 0xff00 block, 0 for keys not in keydefs */
+static unsigned short keytab[256][8][8];
+static char keypool[1 << 15];
+static int keypool_len = 1;
+
+/* Format a key with modifiers as modifyOtherKeys does */
+static int key_format_other(char *buf, size_t size, int code, int mods) {
+    if (FORMAT_OTHER_KEYS) return snprintf(buf, size, "\033[%d;%du", code, mods + 1);
+    return snprintf(buf, size, "\033[27;%d;%d~", mods + 1, code);
+}
+
+/* Encode one keydefs entry for a modifier and mode combination */
+static int key_encode(int k, int mods, int mode, char *buf, size_t size) {
+    int code = keydefs[k].code;
+
+    switch (keydefs[k].type) {
+    case KEY_CURSOR:
+        if (mods) return snprintf(buf, size, "\033[1;%d%c", mods + 1, code);
+        return snprintf(buf, size, (mode & KEYMODE_APPCURSOR) ? "\033O%c" : "\033[%c", code);
+    case KEY_TILDE:
+        if (mods) return snprintf(buf, size, "\033[%d;%d~", code, mods + 1);
+        return snprintf(buf, size, "\033[%d~", code);
+    case KEY_SS3:
+        if (mods) return snprintf(buf, size, "\033[1;%d%c", mods + 1, code);
+        return snprintf(buf, size, "\033O%c", code);
+    case KEY_KEYPAD:
+        if (mode & KEYMODE_APPKEYPAD) {
+            if (mods) return snprintf(buf, size, "\033O%d%c", mods + 1, keydefs[k].appfinal);
+            return snprintf(buf, size, "\033O%c", keydefs[k].appfinal);
+        }
+        break;
+    case KEY_CHAR:
+        if ((mode & KEYMODE_MODOTHER) && mods && !(code == '\t' && mods == KEYMOD_SHIFT)) {
+            return key_format_other(buf, size, code, mods);
+        }
+        if (code == '\t' && (mods & KEYMOD_SHIFT)) return snprintf(buf, size, "\033[Z");
+        if (code == 0x7f && (mods & KEYMOD_CTRL)) code = '\b';
+        break;
+    }
+    return snprintf(buf, size, "%s%c", (mods & KEYMOD_ALT) ? "\033" : "", code);
+}
+
+/* Kitty keyboard protocol key numbers of functional keys, and the
+ * final byte they are sent with: 'u', '~' or a legacy letter */
+static const struct {
+    KeySym keysym;
+    int code;
+    char final;
+} kittydefs[] = {
+    {XK_Escape, 27, 'u'}, {XK_Return, 13, 'u'}, {XK_Tab, 9, 'u'},
+    {XK_ISO_Left_Tab, 9, 'u'}, {XK_BackSpace, 127, 'u'},
+    {XK_Insert, 2, '~'}, {XK_Delete, 3, '~'},
+    {XK_Prior, 5, '~'}, {XK_Next, 6, '~'},
+    {XK_Up, 1, 'A'}, {XK_Down, 1, 'B'}, {XK_Right, 1, 'C'}, {XK_Left, 1, 'D'},
+    {XK_Home, 1, 'H'}, {XK_End, 1, 'F'}, {XK_Begin, 1, 'E'},
+    {XK_F1, 1, 'P'}, {XK_F2, 1, 'Q'}, {XK_F3, 13, '~'}, {XK_F4, 1, 'S'},
+    {XK_F5, 15, '~'}, {XK_F6, 17, '~'}, {XK_F7, 18, '~'}, {XK_F8, 19, '~'},
+    {XK_F9, 20, '~'}, {XK_F10, 21, '~'}, {XK_F11, 23, '~'}, {XK_F12, 24, '~'},
+    {XK_F13, 57376, 'u'}, {XK_F14, 57377, 'u'}, {XK_F15, 57378, 'u'},
+    {XK_F16, 57379, 'u'}, {XK_F17, 57380, 'u'}, {XK_F18, 57381, 'u'},
+    {XK_F19, 57382, 'u'}, {XK_F20, 57383, 'u'},
+    {XK_Caps_Lock, 57358, 'u'}, {XK_Scroll_Lock, 57359, 'u'},
+    {XK_Num_Lock, 57360, 'u'}, {XK_Print, 57361, 'u'},
+    {XK_Pause, 57362, 'u'}, {XK_Menu, 57363, 'u'},
+    {XK_KP_0, 57399, 'u'}, {XK_KP_1, 57400, 'u'}, {XK_KP_2, 57401, 'u'},
+    {XK_KP_3, 57402, 'u'}, {XK_KP_4, 57403, 'u'}, {XK_KP_5, 57404, 'u'},
+    {XK_KP_6, 57405, 'u'}, {XK_KP_7, 57406, 'u'}, {XK_KP_8, 57407, 'u'},
+    {XK_KP_9, 57408, 'u'}, {XK_KP_Decimal, 57409, 'u'},
+    {XK_KP_Divide, 57410, 'u'}, {XK_KP_Multiply, 57411, 'u'},
+    {XK_KP_Subtract, 57412, 'u'}, {XK_KP_Add, 57413, 'u'},
+    {XK_KP_Enter, 57414, 'u'}, {XK_KP_Equal, 57415, 'u'},
+    {XK_KP_Separator, 57416, 'u'}, {XK_KP_Left, 57417, 'u'},
+    {XK_KP_Right, 57418, 'u'}, {XK_KP_Up, 57419, 'u'},
+    {XK_KP_Down, 57420, 'u'}, {XK_KP_Prior, 57421, 'u'},
+    {XK_KP_Next, 57422, 'u'}, {XK_KP_Home, 57423, 'u'},
+    {XK_KP_End, 57424, 'u'}, {XK_KP_Insert, 57425, 'u'},
+    {XK_KP_Delete, 57426, 'u'}, {XK_KP_Begin, 57427, 'u'},
+    {XK_Shift_L, 57441, 'u'}, {XK_Control_L, 57442, 'u'},
+    {XK_Alt_L, 57443, 'u'}, {XK_Super_L, 57444, 'u'},
+    {XK_Hyper_L, 57445, 'u'}, {XK_Meta_L, 57446, 'u'},
+    {XK_Shift_R, 57447, 'u'}, {XK_Control_R, 57448, 'u'},
+    {XK_Alt_R, 57449, 'u'}, {XK_Super_R, 57450, 'u'},
+    {XK_Hyper_R, 57451, 'u'}, {XK_Meta_R, 57452, 'u'},
+    {XK_ISO_Level3_Shift, 57453, 'u'}, {XK_ISO_Level5_Shift, 57454, 'u'},
+};
+
+/* kittytab[keysym & 0xff] indexes kittydefs plus one for keysyms in the
+ * 0xff00 block, 0 if the key is not a functional key */
+static unsigned char kittytab[256];
+static unsigned char keys_down[32]; /* Keycodes held, to detect repeats */
+
+/* Unicode code point of a keysym, -1 if it has none */
+static long keysym_code(KeySym keysym) {
+    if ((keysym >= 0x20 && keysym < 0x7f) || (keysym >= 0xa0 && keysym < 0x100)) return keysym;
+    if ((keysym & 0xff000000) == 0x01000000) return keysym & 0xffffff;
+    return -1;
+}
+
+/* Encode a key event under the kitty keyboard protocol. Returns 0 if
+ * the key is left to the legacy encoding. */
+static int kitty_key(Term *term, XKeyEvent *e, int release) {
+    int flags = kitty_flags(term);
+    char text[32], seq[64];
+    KeySym keysym;
+    int len = XLookupString(e, text, sizeof(text), &keysym, NULL);
+    int down = keys_down[e->keycode / 8] & (1 << (e->keycode % 8));
+    int event = release ? 3 : down ? 2 : 1;
+    int mods = ((e->state & ShiftMask) ? 1 : 0) | ((e->state & Mod1Mask) ? 2 : 0) |
+               ((e->state & ControlMask) ? 4 : 0) | ((e->state & Mod4Mask) ? 8 : 0);
+    int all = flags & KITTY_ALL_KEYS;
+    int csi_u = flags & (KITTY_DISAMBIGUATE | KITTY_ALL_KEYS); /* Keys without a legacy CSI form */
+    int n = 0;
+
+    if (flags & KITTY_ALL_KEYS) {
+        mods |= ((e->state & LockMask) ? 64 : 0) | ((e->state & Mod2Mask) ? 128 : 0);
+    }
+    if (!(flags & KITTY_EVENT_TYPES)) {
+        if (release) return 1; /* Swallowed: releases are not reported */
+        event = 1;
+    }
+
+    int k = (keysym & ~0xffUL) == 0xff00 ? kittytab[keysym & 0xff] : 0;
+    if (k) {
+        int code = kittydefs[k - 1].code;
+        char final = kittydefs[k - 1].final;
+        int legacy_text = code == 13 || code == 9 || code == 127;
+
+        /* Modifier and lock keys alone are only reported with all keys */
+        if ((code >= 57441 || (code >= 57358 && code <= 57360)) && !all) return 1;
+        if (legacy_text && !all && !(mods & ~1) && !(code == 9 && mods)) {
+            /* Enter, Tab and Backspace keep their bytes, so a shell
+             * left in this mode by a crashed program stays usable */
+            return release;
+        }
+        if (final == 'u' && !csi_u) return release; /* Keypad, Escape, ... */
+        if (final != 'u' && final != '~' && !mods && event == 1) {
+            n = snprintf(seq, sizeof(seq), "\033[%c", final);
+        } else if (mods || event != 1) {
+            n = snprintf(seq, sizeof(seq), "\033[%d;%d", code, mods + 1);
+            if (event != 1) n += snprintf(seq + n, sizeof(seq) - n, ":%d", event);
+            n += snprintf(seq + n, sizeof(seq) - n, "%c", final);
+        } else {
+            n = snprintf(seq, sizeof(seq), "\033[%d%c", code, final);
+        }
+        ttywrite(term, seq, n);
+        return 1;
+    }
+
+    /* Text keys are reported by their unshifted code point */
+    long code = keysym_code(XLookupKeysym(e, 0));
+    long shifted = keysym_code(keysym);
+    if (code < 0) return release;
+    if (!all && !(mods & ~1)) {
+        /* Plain text: sent as is, releases are not reported */
+        if (release) return 1;
+        return len <= 0;
+    }
+    if (!csi_u) return release; /* Ctrl and Alt combinations stay legacy */
+    n = snprintf(seq, sizeof(seq), "\033[%ld", code);
+    if ((flags & KITTY_ALTERNATE_KEYS) && (mods & 1) && shifted >= 0 && shifted != code) {
+        n += snprintf(seq + n, sizeof(seq) - n, ":%ld", shifted);
+    }
+    int with_text = (flags & KITTY_ASSOCIATED_TEXT) && event != 3 && shifted >= 0 && !(mods & ~1);
+    if (mods || event != 1 || with_text) {
+        n += snprintf(seq + n, sizeof(seq) - n, ";%d", mods + 1);
+        if (event != 1) n += snprintf(seq + n, sizeof(seq) - n, ":%d", event);
+    }
+    if (with_text) n += snprintf(seq + n, sizeof(seq) - n, ";%ld", shifted);
+    n += snprintf(seq + n, sizeof(seq) - n, "u");
+    ttywrite(term, seq, n);
+    return 1;
+}
+
+/* Handle a key release, which only the kitty protocol reports */
+static void krelease(XKeyEvent *e) {
+    Term *term = term_focused();
+    if (kitty_flags(term) & KITTY_EVENT_TYPES) kitty_key(term, e, 1);
+    keys_down[e->keycode / 8] &= ~(1 << (e->keycode % 8));
+}
+
+/* Precompute the sequence of every special key in every state */
+static void key_init(void) {
+    char buf[32];
+
+    for (size_t k = 0; k < sizeof(keydefs) / sizeof(keydefs[0]); k++) {
+        for (int mods = 0; mods < 8; mods++) {
+            for (int mode = 0; mode < 8; mode++) {
+                int len = key_encode(k, mods, mode, buf, sizeof(buf));
+                if (keypool_len + len + 1 > (int)sizeof(keypool)) die("key table full");
+                memcpy(keypool + keypool_len, buf, len + 1);
+                keytab[keydefs[k].keysym & 0xff][mods][mode] = keypool_len;
+                keypool_len += len + 1;
             }
-            break;
-        case ButtonPress:
-            if (ev.xbutton.button == Button4) { /* Scroll up */
-                term.scroll_offset -= MOUSE_SCROLL_LINES;
-                if (term.scroll_offset < -term.scrollback_len) {
-                    term.scroll_offset = -term.scrollback_len;
-                }
-                xdraw();
-            } else if (ev.xbutton.button == Button5) { /* Scroll down */
-                term.scroll_offset += MOUSE_SCROLL_LINES;
-                if (term.scroll_offset > 0) {
-                    term.scroll_offset = 0;
-                }
-                xdraw();
-            } else if (ev.xbutton.button == Button1) { /* Start selection */
-                term.selecting = 1;
-                term.sel_start_row = (ev.xbutton.y - xw.border) / xw.font_height + term.scrollback_len - term.scroll_offset;
-                term.sel_start_col = (ev.xbutton.x - xw.border) / xw.font_width;
-                term.sel_end_row = term.sel_start_row;
-                term.sel_end_col = term.sel_start_col;
-                if (mouse_enabled && mouse_mode >= 1000) {
-                    /* Send mouse press event to the application */
-                    int x = term.sel_start_col + 1;
-                    int y = term.sel_start_row + 1 - term.scrollback_len + term.scroll_offset;
-                    char buf[32];
-                    snprintf(buf, sizeof(buf), "\033[M %c%c%c", 32, x + 32, y + 32);
-                    ttywrite(buf, strlen(buf));
-                }
+        }
+    }
+    for (size_t k = 0; k < sizeof(kittydefs) / sizeof(kittydefs[0]); k++) {
+        if ((kittydefs[k].keysym & ~0xffUL) == 0xff00) kittytab[kittydefs[k].keysym & 0xff] = k + 1;
+    }
+}
+
+/* Modifier bits of an X key state */
+static int key_mods(unsigned int state) {
+    return ((state & ShiftMask) ? KEYMOD_SHIFT : 0) |
+           ((state & Mod1Mask) ? KEYMOD_ALT : 0) |
+           ((state & ControlMask) ? KEYMOD_CTRL : 0);
+}
+
+/* The shortcut bound to a key, NULL if the key goes to the program */
+static Shortcut *shortcut_find(int mods, KeySym keysym) {
+    KeySym lower, upper;
+
+    XConvertCase(keysym, &lower, &upper);
+    for (int i = 0; i < nbinds; i++) {
+        if (binds[i].mods != mods || binds[i].keysym != lower) continue;
+        return binds[i].action == ACT_NONE ? NULL : &binds[i]; /* none unbinds */
+    }
+    return NULL;
+}
+
+/* Run the shortcut bound to a key, if any; returns whether there was one */
+static int shortcut(Term *term, int mods, KeySym keysym) {
+    Shortcut *sc = shortcut_find(mods, keysym);
+
+    if (!sc) return 0;
+    int arg = sc->arg;
+    switch (sc->action) {
+    case ACT_COPY:
+        copy_selection(term);
+        xdraw();
+        break;
+    case ACT_PASTE:
+        /* Request clipboard contents */
+        XConvertSelection(xw.dpy, xw.atoms[ATOM_CLIPBOARD], XA_STRING, xw.atoms[ATOM_CLIPBOARD],
+                          xw.win, CurrentTime);
+        break;
+    case ACT_SCROLL: /* Scrollback navigation */
+        xscrollview(term, -arg * xw.font_height);
+        break;
+    case ACT_NEW_TAB: tab_new(NULL, NULL); break;
+    case ACT_SPLIT: tab_split(arg); break;
+    case ACT_SELECT_TAB: tab_select(arg); break;
+    case ACT_FOCUS_PANE: tab_focus(arg); break;
+    case ACT_ZOOM: zoom(arg); break;
+    }
+    return 1;
+}
+
+/* Handle a key press: shortcuts first, then one table lookup for
+ * special keys, or the looked up text for ordinary ones */
+static void kpress(XKeyEvent *e) {
+    Term *term = term_focused();
+    char buf[64];
+    KeySym keysym;
+    Status status;
+    int len;
+
+    if (xw.xic) {
+        len = Xutf8LookupString(xw.xic, e, buf, sizeof(buf), &keysym, &status);
+        if (status == XLookupNone || status == XBufferOverflow) return;
+        if (status == XLookupChars) keysym = NoSymbol;
+    } else {
+        len = XLookupString(e, buf, sizeof(buf), &keysym, NULL);
+    }
+    int mods = key_mods(e->state);
+    int ctrl = mods & KEYMOD_CTRL;
+
+    if (shortcut(term, mods, keysym)) return;
+
+    if (kitty_flags(term)) {
+        int handled = kitty_key(term, e, 0);
+        keys_down[e->keycode / 8] |= 1 << (e->keycode % 8);
+        if (handled) return;
+    }
+
+    if (keysym == XK_ISO_Left_Tab) {
+        keysym = XK_Tab;
+        mods |= KEYMOD_SHIFT;
+    }
+    if ((keysym & ~0xffUL) == 0xff00) {
+        int mode = (term->appcursor ? KEYMODE_APPCURSOR : 0) |
+                   (term->appkeypad ? KEYMODE_APPKEYPAD : 0) |
+                   (term->modify_other_keys ? KEYMODE_MODOTHER : 0);
+        unsigned short off = keytab[keysym & 0xff][mods][mode];
+        if (off) {
+            ttywrite(term, keypool + off, strlen(keypool + off));
+            return;
+        }
+    }
+    if (len <= 0) return;
+
+    /* modifyOtherKeys: level 2 reports every Ctrl/Alt combination,
+     * level 1 only those that have no control character of their own */
+    if (term->modify_other_keys && (mods & (KEYMOD_ALT | KEYMOD_CTRL)) &&
+        (term->modify_other_keys >= 2 || (ctrl && (unsigned char)buf[0] >= 32))) {
+        long code = keysym < 0x100 ? (long)keysym :
+                    (keysym & 0xff000000) == 0x01000000 ? (long)(keysym & 0xffffff) : -1;
+        if (code >= 0) {
+            char seq[32];
+            int n = key_format_other(seq, sizeof(seq), code, mods);
+            ttywrite(term, seq, n);
+            return;
+        }
+    }
+    if ((mods & KEYMOD_ALT) && len < (int)sizeof(buf)) { /* Meta sends escape */
+        memmove(buf + 1, buf, len++);
+        buf[0] = '\033';
+    }
+    ttywrite(term, buf, len);
+}
+
+#ifdef XCB
+/* Ask for the pasted selection; xpastereply sends it once it arrives */
+static void xpaste(Atom property) {
+    xw.paste = xcb_get_property(xw.xc, 1, xw.win, property, XCB_GET_PROPERTY_TYPE_ANY, 0, SELECTION_MAX / 4);
+    xw.paste_pending = 1;
+}
+
+static void xpastereply(void) {
+    Term *term = term_focused();
+    xcb_get_property_reply_t *reply = NULL;
+    xcb_generic_error_t *err = NULL;
+
+    if (!xw.paste_pending || !xcb_poll_for_reply(xw.xc, xw.paste.sequence, (void **)&reply, &err)) return;
+    xw.paste_pending = 0;
+    if (reply && reply->format == 8 && xcb_get_property_value_length(reply) > 0) {
+        ttywrite(term, xcb_get_property_value(reply), xcb_get_property_value_length(reply));
+    }
+    free(reply);
+    free(err);
+}
+#else
+/* Paste the selection, reading and deleting its property in one request */
+static void xpaste(Atom property) {
+    Term *term = term_focused();
+    Atom type;
+    int format;
+    unsigned long len, bytes_left;
+    unsigned char *data = NULL;
+
+    if (XGetWindowProperty(xw.dpy, xw.win, property, 0, SELECTION_MAX / 4, True, AnyPropertyType,
+                           &type, &format, &len, &bytes_left, &data) == Success && data) {
+        if (format == 8 && len > 0) ttywrite(term, (char *)data, len);
+        XFree(data);
+    }
+}
+#endif
+
+#ifdef XINPUT2
+/* Scroll by the change of a scroll valuator. XInput2 motion replaces
+ * the core MotionNotify, so pointer motion is handed on as one. */
+static void xinputevent(void *data, int type) {
+    XIDeviceEvent *e = data;
+
+    if (type == XI_DeviceChanged) {
+        xinputaxes();
+        return;
+    }
+    if (type != XI_Motion) return;
+
+    XEvent motion = {.type = MotionNotify};
+    motion.xmotion.x = e->event_x;
+    motion.xmotion.y = e->event_y;
+    motion.xmotion.state = e->mods.effective;
+    for (int b = 1; b <= 5 && b < e->buttons.mask_len * 8; b++) {
+        if (XIMaskIsSet(e->buttons.mask, b)) motion.xmotion.state |= Button1Mask << (b - 1);
+    }
+    xhandle(&motion);
+
+    double *value = e->valuators.values;
+    for (int i = 0; i < e->valuators.mask_len * 8; i++) {
+        if (!XIMaskIsSet(e->valuators.mask, i)) continue;
+        for (int a = 0; a < xw.nscroll_axes; a++) {
+            ScrollAxis *axis = &xw.scroll_axes[a];
+            if (axis->device != e->deviceid || axis->number != i) continue;
+            /* Valuators grow scrolling down, away from the history */
+            xw.scroll_rest -= (*value - axis->last) / axis->increment * MOUSE_SCROLL_LINES * xw.font_height;
+            axis->last = *value;
+        }
+        value++;
+    }
+    int pixels = xw.scroll_rest;
+    if (pixels) {
+        xw.scroll_rest -= pixels;
+        xscrollview(term_focused(), pixels);
+    }
+}
+#endif
+
+/* Handle one X event */
+static void xhandle(XEvent *ev) {
+    Term *term = term_focused();
+    switch (ev->type) {
+#if defined(PRESENT) || defined(XINPUT2)
+    case GenericEvent:
+#ifdef PRESENT
+        if (ev->xcookie.extension == xw.present && XGetEventData(xw.dpy, &ev->xcookie)) {
+            xpresentevent(ev->xcookie.data, ev->xcookie.evtype);
+            XFreeEventData(xw.dpy, &ev->xcookie);
+        }
+#endif
+#ifdef XINPUT2
+        if (ev->xcookie.extension == xw.xi && XGetEventData(xw.dpy, &ev->xcookie)) {
+            xinputevent(ev->xcookie.data, ev->xcookie.evtype);
+            XFreeEventData(xw.dpy, &ev->xcookie);
+        }
+#endif
+        break;
+#endif
+    case Expose:
+        xdraw();
+        break;
+    case ConfigureNotify:
+        {
+            XConfigureEvent *cev = &ev->xconfigure;
+            int new_cols = (cev->width - 2 * xw.border) / xw.font_width;
+            int new_rows = (cev->height - 2 * xw.border) / xw.font_height;
+            if (new_cols != xw.col || new_rows != xw.row) {
+                xresize(new_cols, new_rows);
                 xdraw();
             }
-            break;
-        case ButtonRelease:
-            if (ev.xbutton.button == Button1) {
-                if (term.selecting) {
-                    term.selecting = 0;
-                    copy_selection();
-                }
-                if (mouse_enabled && mouse_mode >= 1000) {
-                    /* Send mouse release event to the application */
-                    int x = term.sel_end_col + 1;
-                    int y = term.sel_end_row + 1 - term.scrollback_len + term.scroll_offset;
-                    char buf[32];
-                    snprintf(buf, sizeof(buf), "\033[M!%c%c", x + 32, y + 32);
-                    ttywrite(buf, strlen(buf));
-                }
-                xdraw();
+        }
+        break;
+    case ButtonPress:
+        pane_click(ev->xbutton.x, ev->xbutton.y);
+        term = term_focused();
+        if (ev->xbutton.button == Button4 || ev->xbutton.button == Button5) {
+#ifdef XINPUT2
+            if (xw.nscroll_axes) break; /* Also reported, finer, by XInput2 */
+#endif
+            int lines = ev->xbutton.button == Button4 ? MOUSE_SCROLL_LINES : -MOUSE_SCROLL_LINES;
+            xscrollview(term, lines * xw.font_height);
+        } else if (ev->xbutton.button == Button1) { /* Start selection */
+            term->selecting = 1;
+            term->sel_start_row = pane_row(term, ev->xbutton.y) + term->scrollback_len + term->scroll_offset;
+            term->sel_start_col = pane_col(term, ev->xbutton.x);
+            term->sel_end_row = term->sel_start_row;
+            term->sel_end_col = term->sel_start_col;
+            if (term->mouse_enabled && term->mouse_mode >= 1000) {
+                /* Send mouse press event to the application */
+                int x = term->sel_start_col + 1;
+                int y = term->sel_start_row + 1 - term->scrollback_len - term->scroll_offset;
+                char buf[32];
+                snprintf(buf, sizeof(buf), "\033[M %c%c%c", 32, x + 32, y + 32);
+                ttywrite(term, buf, strlen(buf));
             }
-            break;
-        case MotionNotify:
-            if (term.selecting) {
-                term.sel_end_row = (ev.xmotion.y - xw.border) / xw.font_height + term.scrollback_len - term.scroll_offset;
-                term.sel_end_col = (ev.xmotion.x - xw.border) / xw.font_width;
-                if (mouse_enabled && mouse_mode >= 1002) {
-                    /* Send mouse motion event to the application */
-                    int x = term.sel_end_col + 1;
-                    int y = term.sel_end_row + 1 - term.scrollback_len + term.scroll_offset;
-                    char buf[32];
-                    snprintf(buf, sizeof(buf), "\033[M\"%c%c", x + 32, y + 32);
-                    ttywrite(buf, strlen(buf));
-                }
-                xdraw();
+            xdraw();
+        }
+        break;
+    case ButtonRelease:
+        if (ev->xbutton.button == Button1) {
+            if (term->selecting) {
+                term->selecting = 0;
+                copy_selection(term);
             }
-            break;
-        case KeyPress:
-            {
+            if (term->mouse_enabled && term->mouse_mode >= 1000) {
+                /* Send mouse release event to the application */
+                int x = term->sel_end_col + 1;
+                int y = term->sel_end_row + 1 - term->scrollback_len - term->scroll_offset;
                 char buf[32];
-                KeySym keysym;
-                int len = XLookupString(&ev.xkey, buf, sizeof(buf), &keysym, NULL);
-                int shift = ev.xkey.state & ShiftMask;
-                int ctrl = ev.xkey.state & ControlMask;
-
-                if (shift && ctrl && keysym == XK_C) { /* Ctrl+Shift+C */
-                    copy_selection();
-                    xdraw();
-                } else if (shift && ctrl && keysym == XK_V) { /* Ctrl+Shift+V */
-                    /* Request clipboard contents */
-                    Atom clipboard = XInternAtom(xw.dpy, "CLIPBOARD", False);
-                    XConvertSelection(xw.dpy, clipboard, XA_STRING, clipboard, xw.win, CurrentTime);
-                } else if (shift && (keysym == XK_Up || keysym == XK_Down)) {
-                    /* Scrollback navigation */
-                    if (keysym == XK_Up) {
-                        term.scroll_offset--;
-                        if (term.scroll_offset < -term.scrollback_len) {
-                            term.scroll_offset = -term.scrollback_len;
-                        }
-                    } else if (keysym == XK_Down) {
-                        term.scroll_offset++;
-                        if (term.scroll_offset > 0) {
-                            term.scroll_offset = 0;
-                        }
-                    }
-                    xdraw();
-                } else if (ctrl && keysym == XK_c) { /* Ctrl+C */
-                    ttywrite("\003", 1);
-                    xdraw();
-                } else if (ctrl && keysym == XK_v) { /* Ctrl+V */
-                    /* Request clipboard contents */
-                    Atom clipboard = XInternAtom(xw.dpy, "CLIPBOARD", False);
-                    XConvertSelection(xw.dpy, clipboard, XA_STRING, clipboard, xw.win, CurrentTime);
-                } else if (len > 0) {
-                    ttywrite(buf, len);
-                    xdraw();
-                } else {
-                    /* Handle special keys */
-                    switch (keysym) {
-                    case XK_Up:
-                        ttywrite(shift ? "\033[1;2A" : "\033[A", shift ? 6 : 3);
-                        break;
-                    case XK_Down:
-                        ttywrite(shift ? "\033[1;2B" : "\033[B", shift ? 6 : 3);
-                        break;
-                    case XK_Right:
-                        ttywrite(shift ? "\033[1;2C" : "\033[C", shift ? 6 : 3);
-                        break;
-                    case XK_Left:
-                        ttywrite(shift ? "\033[1;2D" : "\033[D", shift ? 6 : 3);
-                        break;
-                    case XK_Return:
-                        ttywrite("\r", 1);
-                        break;
-                    case XK_BackSpace:
-                        ttywrite("\b", 1);
-                        break;
-                    case XK_Tab:
-                        ttywrite("\t", 1);
-                        break;
-                    }
-                    xdraw();
-                }
+                snprintf(buf, sizeof(buf), "\033[M!%c%c", x + 32, y + 32);
+                ttywrite(term, buf, strlen(buf));
             }
-            break;
-        case SelectionNotify:
-            {
-                XSelectionEvent *sev = &ev.xselection;
-                if (sev->property != None) {
-                    Atom type;
-                    int format;
-                    unsigned long len, bytes_left;
-                    unsigned char *data;
-                    XGetWindowProperty(xw.dpy, xw.win, sev->property, 0, 0, False,
-                                       AnyPropertyType, &type, &format, &len, &bytes_left, &data);
-                    if (bytes_left > 0) {
-                        XGetWindowProperty(xw.dpy, xw.win, sev->property, 0, bytes_left,
-                                           False, AnyPropertyType, &type, &format, &len, &bytes_left, &data);
-                        ttywrite((char *)data, len);
-                        XFree(data);
-                    }
-                }
+            xdraw();
+        }
+        break;
+    case MotionNotify:
+        if (term->selecting) {
+            term->sel_end_row = pane_row(term, ev->xmotion.y) + term->scrollback_len + term->scroll_offset;
+            term->sel_end_col = pane_col(term, ev->xmotion.x);
+            if (term->mouse_enabled && term->mouse_mode >= 1002) {
+                /* Send mouse motion event to the application */
+                int x = term->sel_end_col + 1;
+                int y = term->sel_end_row + 1 - term->scrollback_len - term->scroll_offset;
+                char buf[32];
+                snprintf(buf, sizeof(buf), "\033[M\"%c%c", x + 32, y + 32);
+                ttywrite(term, buf, strlen(buf));
             }
-            break;
+            xdraw();
+        }
+        break;
+    case FocusIn:
+    case FocusOut:
+        /* Ignore the focus bouncing of keyboard grabs */
+        if (ev->xfocus.mode == NotifyGrab || ev->xfocus.mode == NotifyUngrab) break;
+        if ((ev->type == FocusIn) == xw.focused) break;
+        xw.focused = ev->type == FocusIn;
+        if (xw.xic) {
+            if (xw.focused) XSetICFocus(xw.xic);
+            else XUnsetICFocus(xw.xic);
+        }
+        if (term->focus_report) ttywrite(term, xw.focused ? "\033[I" : "\033[O", 3);
+        break;
+    case KeyPress:
+        kpress(&ev->xkey);
+        break;
+    case KeyRelease:
+        krelease(&ev->xkey);
+        break;
+    case SelectionNotify:
+        {
+            if (ev->xselection.property != None) xpaste(ev->xselection.property);
+        }
+        break;
+    case PropertyNotify:
+        if (ev->xproperty.atom == xw.atoms[ATOM_RESOURCE_MANAGER]) {
+            /* Rescaled when the next frame is drawn */
+            xw.dpi_stale = 1;
+            dirty = 1;
+        }
+        break;
+    }
+}
+
+#ifdef XCB
+/* Give a core event from XCB the shape the handlers expect. The event
+ * codes and masks are the same in both libraries. */
+static int xcbconvert(xcb_generic_event_t *e, XEvent *ev) {
+    memset(ev, 0, sizeof(*ev));
+    ev->type = e->response_type & 0x7f;
+    ev->xany.send_event = (e->response_type & 0x80) != 0;
+    ev->xany.display = xw.dpy;
+    ev->xany.window = xw.win;
+
+    switch (ev->type) {
+    case Expose:
+        ev->xexpose.count = ((xcb_expose_event_t *)e)->count;
+        return 1;
+    case ConfigureNotify:
+        ev->xconfigure.width = ((xcb_configure_notify_event_t *)e)->width;
+        ev->xconfigure.height = ((xcb_configure_notify_event_t *)e)->height;
+        return 1;
+    case KeyPress:
+    case KeyRelease:
+    case ButtonPress:
+    case ButtonRelease:
+    case MotionNotify: {
+        /* Key, button and motion events share one layout in both */
+        xcb_key_press_event_t *k = (xcb_key_press_event_t *)e;
+        ev->xkey.root = k->root;
+        ev->xkey.subwindow = k->child;
+        ev->xkey.time = k->time;
+        ev->xkey.x = k->event_x;
+        ev->xkey.y = k->event_y;
+        ev->xkey.x_root = k->root_x;
+        ev->xkey.y_root = k->root_y;
+        ev->xkey.state = k->state;
+        ev->xkey.keycode = k->detail;
+        ev->xkey.same_screen = k->same_screen;
+        if (ev->type == ButtonPress || ev->type == ButtonRelease) ev->xbutton.button = k->detail;
+        return 1;
+    }
+    case FocusIn:
+    case FocusOut:
+        ev->xfocus.mode = ((xcb_focus_in_event_t *)e)->mode;
+        ev->xfocus.detail = ((xcb_focus_in_event_t *)e)->detail;
+        return 1;
+    case PropertyNotify:
+        ev->xproperty.window = ((xcb_property_notify_event_t *)e)->window;
+        ev->xproperty.atom = ((xcb_property_notify_event_t *)e)->atom;
+        ev->xproperty.state = ((xcb_property_notify_event_t *)e)->state;
+        return 1;
+    case SelectionNotify: {
+        xcb_selection_notify_event_t *sel = (xcb_selection_notify_event_t *)e;
+        ev->xselection.requestor = sel->requestor;
+        ev->xselection.selection = sel->selection;
+        ev->xselection.target = sel->target;
+        ev->xselection.property = sel->property;
+        ev->xselection.time = sel->time;
+        return 1;
+    }
+    }
+    return 0;
+}
+
+#ifdef PRESENT
+/* Decode a Present event from the wire. XCB inserts the full sequence
+ * number at byte 32, which moves the completion MSC to byte 36. */
+static void xcbpresent(xcb_ge_generic_event_t *ge) {
+    const unsigned char *p = (const unsigned char *)ge;
+    uint32_t serial;
+
+    memcpy(&serial, p + 20, sizeof(serial));
+    if (ge->event_type == PresentCompleteNotify) {
+        XPresentCompleteNotifyEvent e = {.serial_number = serial, .kind = p[10], .mode = p[11]};
+        memcpy(&e.ust, p + 24, sizeof(e.ust));
+        memcpy(&e.msc, p + 36, sizeof(e.msc));
+        xpresentevent(&e, PresentCompleteNotify);
+    } else if (ge->event_type == PresentIdleNotify) {
+        XPresentIdleNotifyEvent e = {.serial_number = serial};
+        xpresentevent(&e, PresentIdleNotify);
+    }
+}
+#endif
+
+/* Handle X events without ever blocking: xcb_poll_for_event reads the
+ * socket only when its queue is empty, so once it returns NULL
+ * everything the server sent is handled and the descriptor's
+ * readiness is exact for the event loop. */
+void xevent(void) {
+    xcb_generic_event_t *e;
+    XEvent ev;
+
+    while ((e = xw.xcb_queued ? xw.xcb_queue[0] : xcb_poll_for_event(xw.xc))) {
+        if (xw.xcb_queued) memmove(xw.xcb_queue, xw.xcb_queue + 1, --xw.xcb_queued * sizeof(e));
+#ifdef PRESENT
+        if ((e->response_type & 0x7f) == XCB_GE_GENERIC &&
+            ((xcb_ge_generic_event_t *)e)->extension == xw.present) {
+            xcbpresent((xcb_ge_generic_event_t *)e);
+        } else
+#endif
+        if (xcbconvert(e, &ev)) {
+            xhandle(&ev);
         }
+        free(e);
+    }
+    if (xcb_connection_has_error(xw.xc)) die("X connection lost");
+    xpastereply();
+    XFlush(xw.dpy); /* Requests made by the handlers */
+}
+#else
+/* Handle X11 events. The connection is read once; events arriving
+ * later wake the event loop again, so there is no polling here. */
+void xevent(void) {
+    XEvent ev;
+    XEventsQueued(xw.dpy, QueuedAfterReading);
+    while (XEventsQueued(xw.dpy, QueuedAlready)) {
+        XNextEvent(xw.dpy, &ev);
+        if (XFilterEvent(&ev, None)) continue; /* Consumed by the input method */
+        xhandle(&ev);
+    }
+    XFlush(xw.dpy); /* Requests made by the handlers */
+}
+#endif
+
+/* Whether a key press would send the byte that interrupts, quits or
+ * suspends a terminal's program, the way kpress encodes it */
+static int key_interrupts(Term *term, XKeyEvent *e) {
+    char buf[8];
+    KeySym keysym;
+    int len = XLookupString(e, buf, sizeof(buf), &keysym, NULL);
+    int mods = key_mods(e->state);
+
+    if (len != 1 || (mods & KEYMOD_ALT) || shortcut_find(mods, keysym)) return 0;
+    if (kitty_flags(term) || term->modify_other_keys >= 2) return 0; /* Sent as sequences */
+    return ttyintr(term, buf[0]);
+}
+
+#ifndef XCB
+static XKeyEvent xkeys[16]; /* Key presses seen by xkeyscan */
+static int nxkeys;
+
+/* XCheckIfEvent predicate that copies the key presses and takes none */
+static Bool xkeyscan(Display *dpy, XEvent *ev, XPointer arg) {
+    (void)dpy;
+    (void)arg;
+    if (ev->type == KeyPress && nxkeys < (int)(sizeof(xkeys) / sizeof(xkeys[0]))) xkeys[nxkeys++] = ev->xkey;
+    return False;
+}
+#endif
+
+/* Whether the user pressed the key that interrupts the focused
+ * terminal, which is being parsed. The events stay queued. */
+static int xintr_pending(Term *term) {
+    if (term != term_focused()) return 0;
+#ifdef XCB
+    xcb_generic_event_t *e;
+    XEvent ev;
+
+    while (xw.xcb_queued < XCB_QUEUE_SIZE && (e = xcb_poll_for_event(xw.xc))) {
+        xw.xcb_queue[xw.xcb_queued++] = e;
     }
+    for (int i = 0; i < xw.xcb_queued; i++) {
+        e = xw.xcb_queue[i];
+        if ((e->response_type & 0x7f) == KeyPress && xcbconvert(e, &ev) && key_interrupts(term, &ev.xkey)) return 1;
+    }
+#else
+    XEvent ev;
+
+    XEventsQueued(xw.dpy, QueuedAfterReading);
+    nxkeys = 0;
+    XCheckIfEvent(xw.dpy, &ev, xkeyscan, NULL);
+    for (int i = 0; i < nxkeys; i++) {
+        if (key_interrupts(term, &xkeys[i])) return 1;
+    }
+#endif
+    return 0;
 }
 
 
 /* Free X11 resources */
 void xfree(void) {
+    if (xw.xic) XDestroyIC(xw.xic);
+    if (xw.xim) XCloseIM(xw.xim);
+    if (xw.spotlist) XFree(xw.spotlist);
     for (int i = 0; i < 16; i++) {
-        XftColorFree(xw.dpy, DefaultVisual(xw.dpy, DefaultScreen(xw.dpy)),
-                     DefaultColormap(xw.dpy, DefaultScreen(xw.dpy)), &xw.colors[i]);
+        XRenderFreePicture(xw.dpy, xw.fills[i]);
+        XftColorFree(xw.dpy, xw.visual, xw.colormap, &xw.colors[i]);
     }
     XftDrawDestroy(xw.draw);
+    XFreeGC(xw.dpy, xw.gc);
     XFreePixmap(xw.dpy, xw.pixmap);
-    XftFontClose(xw.dpy, xw.font);
+    for (int i = 0; i < FONT_CACHE_SIZE; i++) font_close(&xw.fonts[i]);
     XDestroyWindow(xw.dpy, xw.win);
     XCloseDisplay(xw.dpy);
 }
 
+/* Report a bad line of the config file */
+static void config_error(int line, const char *msg, const char *value) {
+    fprintf(stderr, "slimterm: %s:%d: %s: %s\n", config_path, line, msg, value);
+}
+
+/* Parse "mods+key action [arg]" into a shortcut; -1 if it is not one */
+static int config_bind(char *value, Shortcut *sc) {
+    char *key = strtok(value, " \t"), *action = strtok(NULL, " \t"), *arg = strtok(NULL, " \t");
+    KeySym upper;
+
+    if (!key || !action) return -1;
+    memset(sc, 0, sizeof(*sc));
+    for (char *plus; (plus = strchr(key, '+')) && plus[1]; key = plus + 1) {
+        *plus = '\0';
+        if (strcmp(key, "ctrl") == 0) sc->mods |= KEYMOD_CTRL;
+        else if (strcmp(key, "shift") == 0) sc->mods |= KEYMOD_SHIFT;
+        else if (strcmp(key, "alt") == 0) sc->mods |= KEYMOD_ALT;
+        else return -1;
+    }
+    XConvertCase(XStringToKeysym(key), &sc->keysym, &upper);
+    if (sc->keysym == NoSymbol) return -1;
+    for (sc->action = 0; sc->action < ACT_LAST; sc->action++) {
+        if (strcmp(action, action_names[sc->action]) == 0) break;
+    }
+    if (sc->action == ACT_LAST) return -1;
+    if (arg) sc->arg = atoi(arg);
+    return 0;
+}
+
+/* Read the config file over the defaults from config.h and apply what
+ * changed: colors are allocated again, a new font replaces the font
+ * sets, and the scrollback rings are resized. Lines are "key = value"
+ * or comments starting with '#'. A missing file leaves the defaults. */
+static void config_load(void) {
+    const char *font = FONT_NAME;
+    const char *names[16];
+    int border = BORDER_WIDTH, scrollback = SCROLLBACK_SIZE;
+    Shortcut next[MAX_SHORTCUTS];
+    int nnext = sizeof(shortcuts) / sizeof(shortcuts[0]);
+    char *text = NULL, *line, *eol;
+    FILE *f;
+
+    config_reload = 0;
+    memcpy(names, colors, sizeof(names));
+    memcpy(next, shortcuts, sizeof(shortcuts));
+    if (config_path && (f = fopen(config_path, "r"))) {
+        size_t len = 0, cap = 0;
+        for (size_t n = 1; n > 0; len += n) {
+            if (cap - len < BUFSIZE) text = xrealloc(text, cap += BUFSIZE + 1);
+            n = fread(text + len, 1, BUFSIZE, f);
+        }
+        text[len] = '\0';
+        fclose(f);
+    }
+
+    eol = text;
+    for (int n = 1; (line = eol); n++) {
+        char *key, *value, *end;
+        int idx, len;
+        eol = strchr(line, '\n');
+        if (eol) *eol++ = '\0';
+        key = line + strspn(line, " \t");
+        if (!*key || *key == '#') continue;
+        if (!(value = strchr(key, '='))) {
+            config_error(n, "expected key = value", key);
+            continue;
+        }
+        for (end = value; end > key && (end[-1] == ' ' || end[-1] == '\t'); end--);
+        *end = '\0';
+        value += 1 + strspn(value + 1, " \t");
+        for (end = value + strlen(value); end > value && (end[-1] == ' ' || end[-1] == '\t'); end--);
+        *end = '\0';
+
+        long num = strtol(value, &end, 10);
+        int is_num = *value && !*end;
+        if (strcmp(key, "font") == 0) {
+            font = value;
+        } else if (sscanf(key, "color%d%n", &idx, &len) == 1 && !key[len] && idx >= 0 && idx < 16) {
+            names[idx] = value;
+        } else if (strcmp(key, "border") == 0 && is_num && num >= 0 && num <= 1000) {
+            border = num;
+        } else if (strcmp(key, "scrollback") == 0 && is_num && num >= 0 && num <= 1000000) {
+            scrollback = num;
+        } else if (strcmp(key, "bind") == 0) {
+            Shortcut sc;
+            char spec[256];
+            int i;
+            snprintf(spec, sizeof(spec), "%s", value);
+            if (config_bind(spec, &sc) < 0) {
+                config_error(n, "bad binding", value);
+                continue;
+            }
+            /* A key bound again replaces its earlier action */
+            for (i = 0; i < nnext && (next[i].mods != sc.mods || next[i].keysym != sc.keysym); i++);
+            if (i == MAX_SHORTCUTS) {
+                config_error(n, "too many bindings", value);
+                continue;
+            }
+            next[i] = sc;
+            nnext = MAX(nnext, i + 1);
+        } else {
+            config_error(n, "unknown setting or bad value", key);
+        }
+    }
+
+    /* Apply the changes; before xinit only the settings are kept */
+    int refit = 0;
+    for (int i = 0; i < 16; i++) {
+        if (color_names[i] && strcmp(color_names[i], names[i]) == 0) continue;
+        if (xw.win && xloadcolor(i, names[i]) < 0) {
+            fprintf(stderr, "slimterm: %s: unknown color: %s\n", config_path, names[i]);
+            continue;
+        }
+        free(color_names[i]);
+        color_names[i] = xstrdup(names[i]);
+    }
+    if (!font_name || strcmp(font_name, font) != 0) {
+        if (xw.win && font_load(font) < 0) {
+            fprintf(stderr, "slimterm: %s: cannot open font: %s\n", config_path, font);
+        } else {
+            free(font_name);
+            font_name = xstrdup(font);
+            refit = 1;
+        }
+    }
+    if (border != border_width) {
+        border_width = border;
+        xw.border = xborder();
+        refit = 1;
+    }
+    if (scrollback != scrollback_size) {
+        scrollback_size = scrollback;
+        for (int i = 0; i < ntabs; i++) {
+            for (int p = 0; p < tabs[i].npanes; p++) term_scrollback_resize(tabs[i].panes[p], scrollback);
+        }
+    }
+    memcpy(binds, next, nnext * sizeof(*next));
+    nbinds = nnext;
+    free(text);
+    if (xw.win) {
+        if (refit) xfit();
+        dirty = 1;
+    }
+}
+
+/* Find the config file and watch its directory, where editors often
+ * replace the file rather than write to it */
+static void config_init(const char *path) {
+    const char *dir = getenv("XDG_CONFIG_HOME"), *home = getenv("HOME");
+    char buf[PATH_MAX];
+
+    if (path) {
+        config_path = xstrdup(path);
+    } else if (dir && *dir) {
+        snprintf(buf, sizeof(buf), "%s/slimterm/config", dir);
+        config_path = xstrdup(buf);
+    } else if (home) {
+        snprintf(buf, sizeof(buf), "%s/.config/slimterm/config", home);
+        config_path = xstrdup(buf);
+    }
+    config_load();
+    if (!config_path) return;
+
+#if defined(__linux)
+    char *slash = strrchr(config_path, '/');
+    if (!slash) strcpy(buf, ".");
+    else if (slash == config_path) strcpy(buf, "/");
+    else snprintf(buf, sizeof(buf), "%.*s", (int)(slash - config_path), config_path);
+    config_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (config_fd >= 0 && inotify_add_watch(config_fd, buf, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        close(config_fd);
+        config_fd = -1;
+    }
+#endif
+}
+
+/* Reload the config file if one of the inotify events is about it */
+static void config_event(void) {
+#if defined(__linux)
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *slash = strrchr(config_path, '/');
+    const char *name = slash ? slash + 1 : config_path;
+    ssize_t n;
+
+    while ((n = read(config_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len && strcmp(ev->name, name) == 0) config_reload = 1;
+        }
+    }
+    if (config_reload) config_load();
+#endif
+}
+
+/* Minimum time between redraws. Unfocused windows redraw less often so
+ * they do not compete for the X server with the one being used; they
+ * still parse at full speed. With Present, focused windows draw once
+ * per refresh instead. */
+static double frame_interval(void) {
+#ifdef PRESENT
+    if (xw.present && xw.focused) return xw.present_period;
+#endif
+    return xw.focused ? FRAME_INTERVAL : UNFOCUSED_FRAME_INTERVAL;
+}
+
+/* Parse budget per frame in throttle mode, in ms */
+static double parse_budget(void) {
+    return frame_interval() * PARSE_BUDGET / 100.0;
+}
+
+/* Whether output should be left in the PTY for now, blocking the child */
+static int ttythrottled(void) {
+    return log_full() || (bp_throttle && frame_parse_ms >= parse_budget());
+}
+
+/* Read from a PTY and account the time spent parsing */
+static void frame_read(Term *t) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ttyread(t);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    frame_parse_ms += TIMEDIFF(end, start);
+}
+
+/* Milliseconds until the pending frame is due, or -1 if there is none */
+static double frame_wait(void) {
+    struct timespec now;
+    if (!dirty && !badges_stale) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#ifdef PRESENT
+    if (xw.present && xw.present_pending) {
+        /* The completion event is the frame clock; it wakes us up */
+        double left = PRESENT_TIMEOUT - TIMEDIFF(now, last_draw);
+        if (left > 0) return left;
+        xw.present_pending = 0;
+    }
+    if (xw.present && xw.focused) return 0;
+#endif
+    return MAX(frame_interval() - TIMEDIFF(now, last_draw), 0);
+}
+
+/* Draw the pending frame and re-evaluate the backpressure policy. The
+ * loop is saturated when parsing and drawing took up nearly the whole
+ * frame; a few such frames in a row switch to throttling, and a few
+ * throttled frames that did not exhaust the parse budget switch back. */
+static void frame_draw(void) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double frame_ms = TIMEDIFF(start, last_draw);
+    if (xw.dpi_stale) xrescale();
+    if (dirty) xdraw();
+    else xdrawbadges();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double draw_ms = TIMEDIFF(end, start);
+
+    if (bp_policy == BP_AUTO) {
+        double load = (frame_parse_ms + draw_ms) / MAX(frame_ms + draw_ms, frame_interval());
+        int flip = bp_throttle ? frame_parse_ms < parse_budget() : load > 0.9;
+        if (!flip) {
+            bp_streak = 0;
+        } else if (++bp_streak >= 4) {
+            bp_throttle = !bp_throttle;
+            bp_streak = 0;
+        }
+    }
+    frame_parse_ms = 0;
+    if (debug_x) xdebugframe();
+    last_draw = end;
+    dirty = 0;
+    badges_stale = 0;
+}
+
+#ifdef IOURING
+/* Set up the ring and register the PTY read buffers; returns -1 if the
+ * kernel lacks io_uring or provided buffer rings (Linux < 5.19) */
+static int ur_init(void) {
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    char *rings = MAP_FAILED;
+    size_t ringsz = 0;
+
+    ur.sqes = MAP_FAILED;
+    ur.br = MAP_FAILED;
+    memset(&p, 0, sizeof(p));
+    ur.fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+    if (ur.fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) goto fail;
+
+    size_t sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ringsz = MAX(sqsz, cqsz);
+    rings = mmap(NULL, ringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) goto fail;
+    ur.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_SQES);
+    if (ur.sqes == MAP_FAILED) goto fail;
+    ur.sq_entries = p.sq_entries;
+    ur.sq_head = (unsigned int *)(rings + p.sq_off.head);
+    ur.sq_tail = (unsigned int *)(rings + p.sq_off.tail);
+    ur.sq_mask = (unsigned int *)(rings + p.sq_off.ring_mask);
+    ur.sq_array = (unsigned int *)(rings + p.sq_off.array);
+    ur.cq_head = (unsigned int *)(rings + p.cq_off.head);
+    ur.cq_tail = (unsigned int *)(rings + p.cq_off.tail);
+    ur.cq_mask = (unsigned int *)(rings + p.cq_off.ring_mask);
+    ur.cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    ur.sq_local_tail = *ur.sq_tail;
+
+    ur.br = mmap(NULL, UR_NBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ur.br == MAP_FAILED) goto fail;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ur.br;
+    reg.ring_entries = UR_NBUFS;
+    reg.bgid = UR_BGID;
+    if (syscall(__NR_io_uring_register, ur.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) goto fail;
+
+    ur.bufs = xmalloc(UR_NBUFS * BUFSIZE);
+    for (int i = 0; i < UR_NBUFS; i++) {
+        struct io_uring_buf *b = &ur.br->bufs[i];
+        b->addr = (uintptr_t)(ur.bufs + i * BUFSIZE);
+        b->len = BUFSIZE;
+        b->bid = i;
+    }
+    __atomic_store_n(&ur.br->tail, UR_NBUFS, __ATOMIC_RELEASE);
+    return 0;
+
+fail:
+    /* Undo what was mapped; the select loop takes over */
+    if (ur.br != MAP_FAILED) munmap(ur.br, UR_NBUFS * sizeof(struct io_uring_buf));
+    if (ur.sqes != MAP_FAILED) munmap(ur.sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+    if (rings != MAP_FAILED) munmap(rings, ringsz);
+    close(ur.fd);
+    memset(&ur, 0, sizeof(ur));
+    return -1;
+}
+
+/* Give a consumed PTY buffer back to the kernel */
+static void ur_recycle(int bid) {
+    unsigned short tail = ur.br->tail;
+    struct io_uring_buf *b = &ur.br->bufs[tail & (UR_NBUFS - 1)];
+    b->addr = (uintptr_t)(ur.bufs + bid * BUFSIZE);
+    b->len = BUFSIZE;
+    b->bid = bid;
+    __atomic_store_n(&ur.br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Hand the prepared SQEs to the kernel without waiting */
+static void ur_submit(void) {
+    __atomic_store_n(ur.sq_tail, ur.sq_local_tail, __ATOMIC_RELEASE);
+    int ret = syscall(__NR_io_uring_enter, ur.fd, ur.to_submit, 0, 0, NULL, 0);
+    if (ret < 0 && errno != EINTR) die("io_uring_enter failed");
+    if (ret > 0) ur.to_submit -= ret;
+}
+
+/* Get a cleared submission queue entry, submitting first if the queue
+ * is full */
+static struct io_uring_sqe *ur_sqe(unsigned long long user_data) {
+    while (ur.sq_local_tail - __atomic_load_n(ur.sq_head, __ATOMIC_ACQUIRE) >= ur.sq_entries) ur_submit();
+    unsigned int idx = ur.sq_local_tail++ & *ur.sq_mask;
+    struct io_uring_sqe *sqe = &ur.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ur.sq_array[idx] = idx;
+    ur.to_submit++;
+    return sqe;
+}
+
+static void ur_settime(struct __kernel_timespec *ts, double ms) {
+    ts->tv_sec = ms / 1000;
+    ts->tv_nsec = (ms - ts->tv_sec * 1000) * 1E6;
+}
+
+/* Queue a read of a terminal's PTY into a provided buffer */
+static void ur_arm_pty(Term *t) {
+    struct io_uring_sqe *sqe = ur_sqe((unsigned long long)t->id << 8 | UR_PTY);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = t->master_fd;
+    sqe->off = -1;
+    sqe->len = BUFSIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UR_BGID;
+    t->ur_armed = 1;
+}
+
+/* Find a terminal by id; it may have closed while its read was queued */
+static Term *term_byid(unsigned int id) {
+    for (int i = 0; i < ntabs; i++) {
+        for (int p = 0; p < tabs[i].npanes; p++) {
+            if (tabs[i].panes[p]->id == id) return tabs[i].panes[p];
+        }
+    }
+    return NULL;
+}
+
+/* Main event loop on io_uring */
+static void run_uring(void) {
+    int xfd = ConnectionNumber(xw.dpy);
+    int wake_armed = 0;
+
+    /* Multishot poll: one SQE keeps reporting X connection readability */
+    struct io_uring_sqe *sqe = ur_sqe(UR_X);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = xfd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    if (config_fd >= 0) {
+        sqe = ur_sqe(UR_CONFIG);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = config_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+
+    while (1) {
+        /* While throttled, leave output in the PTYs until the next
+         * frame is drawn or the log writer catches up */
+        int throttled = ttythrottled();
+        if (!throttled) {
+            for (int i = 0; i < ntabs; i++) {
+                for (int p = 0; p < tabs[i].npanes; p++) {
+                    Term *t = tabs[i].panes[p];
+                    if (!t->ur_armed && !t->hung_up) ur_arm_pty(t);
+                }
+            }
+        }
+        double wait = frame_wait();
+        if (!wake_armed && (wait >= 0 || throttled)) {
+            /* Wake up to draw the pending frame. This is a standalone
+             * timeout rather than one linked to a PTY read: a linked
+             * timeout cancels the read it guards when it fires, there is
+             * no read to link to while throttled, and with several
+             * terminals no single read stands for the frame deadline. */
+            ur_settime(&ur.wake_ts, wait >= 0 ? MAX(wait, 0.01) : 10);
+            sqe = ur_sqe(UR_WAKE);
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = (uintptr_t)&ur.wake_ts;
+            sqe->len = 1;
+            wake_armed = 1;
+        }
+
+        __atomic_store_n(ur.sq_tail, ur.sq_local_tail, __ATOMIC_RELEASE);
+        int ret = syscall(__NR_io_uring_enter, ur.fd, ur.to_submit, 1,
+                          IORING_ENTER_GETEVENTS, &orig_sigmask, _NSIG / 8);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                if (child_exited) child_reap();
+                if (config_reload) config_load();
+                continue;
+            }
+            die("io_uring_enter failed");
+        }
+        ur.to_submit -= ret;
+
+        unsigned int head = *ur.cq_head;
+        while (head != __atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = ur.cqes[head & *ur.cq_mask];
+            __atomic_store_n(ur.cq_head, ++head, __ATOMIC_RELEASE);
+
+            switch (cqe.user_data & 0xff) {
+            case UR_PTY: {
+                Term *t = term_byid(cqe.user_data >> 8);
+                if (!t) {
+                    /* Its terminal closed; only the buffer is left */
+                    if (cqe.flags & IORING_CQE_F_BUFFER) ur_recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                    break;
+                }
+                t->ur_armed = 0;
+                if (cqe.res > 0) {
+                    int bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                    char *buf = ur.bufs + bid * BUFSIZE;
+                    struct timespec start, end;
+                    clock_gettime(CLOCK_MONOTONIC, &start);
+                    LogChunk *chunk = log_slot(t);
+                    if (chunk) {
+                        memcpy(chunk->buf, buf, cqe.res);
+                        log_commit(t, chunk, cqe.res);
+                    }
+                    ttyparse(t, buf, cqe.res);
+                    ur_recycle(bid);
+                    clock_gettime(CLOCK_MONOTONIC, &end);
+                    frame_parse_ms += TIMEDIFF(end, start);
+                } else if (cqe.res == 0 || cqe.res == -EIO) {
+                    ttyhangup(t);
+                } else if (cqe.res != -ECANCELED && cqe.res != -EINTR &&
+                           cqe.res != -EAGAIN && cqe.res != -ENOBUFS) {
+                    errno = -cqe.res;
+                    die("read from PTY failed");
+                }
+                break;
+            }
+            case UR_X:
+                xevent();
+                if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                    sqe = ur_sqe(UR_X);
+                    sqe->opcode = IORING_OP_POLL_ADD;
+                    sqe->fd = xfd;
+                    sqe->poll32_events = POLLIN;
+                    sqe->len = IORING_POLL_ADD_MULTI;
+                }
+                break;
+            case UR_WAKE:
+                wake_armed = 0;
+                break;
+            case UR_CONFIG:
+                config_event();
+                if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                    sqe = ur_sqe(UR_CONFIG);
+                    sqe->opcode = IORING_OP_POLL_ADD;
+                    sqe->fd = config_fd;
+                    sqe->poll32_events = POLLIN;
+                    sqe->len = IORING_POLL_ADD_MULTI;
+                }
+                break;
+            }
+        }
+
+        /* Events Xlib already read while flushing requests */
+        if (xqueued()) xevent();
+
+        if (frame_wait() == 0) frame_draw();
+    }
+}
+#endif
+
 /* Main event loop */
 void run(void) {
+#ifdef IOURING
+    if (use_uring) {
+        if (ur_init() == 0) {
+            run_uring();
+            return;
+        }
+        fprintf(stderr, "slimterm: io_uring unavailable, falling back to select\n");
+    }
+#endif
+
     fd_set rfds;
     int xfd = ConnectionNumber(xw.dpy);
-    int max_fd = master_fd > xfd ? master_fd : xfd;
+    Term *ready[MAX_TABS * MAX_PANES];
 
     while (1) {
+        /* Wake up for the pending frame; while throttled without one
+         * (the session log is full), poll again shortly */
+        double wait = frame_wait();
+        int throttled = ttythrottled();
+        if (wait < 0 && throttled) wait = 10;
+        struct timespec timeout = {wait / 1000, (wait - (int)(wait / 1000) * 1000) * 1E6};
+
         FD_ZERO(&rfds);
-        FD_SET(master_fd, &rfds);
         FD_SET(xfd, &rfds);
-
-        if (select(max_fd + 1, &rfds, NULL, NULL, NULL) < 0) {
-            if (errno == EINTR) continue;
-            die("select failed");
+        int max_fd = xfd;
+        if (config_fd >= 0) {
+            FD_SET(config_fd, &rfds);
+            max_fd = MAX(max_fd, config_fd);
+        }
+        for (int i = 0; i < ntabs && !throttled; i++) {
+            for (int p = 0; p < tabs[i].npanes; p++) {
+                if (tabs[i].panes[p]->hung_up) continue;
+                FD_SET(tabs[i].panes[p]->master_fd, &rfds);
+                max_fd = MAX(max_fd, tabs[i].panes[p]->master_fd);
+            }
         }
 
-        if (FD_ISSET(master_fd, &rfds)) {
-            ttyread();
-            xdraw();
+        if (pselect(max_fd + 1, &rfds, NULL, NULL, wait >= 0 ? &timeout : NULL, &orig_sigmask) < 0) {
+            if (errno == EINTR) {
+                if (child_exited) child_reap();
+                if (config_reload) config_load();
+                continue;
+            }
+            die("select failed");
         }
 
+        /* Input first, so keys are never queued behind output */
         if (FD_ISSET(xfd, &rfds)) {
             xevent();
         }
+        if (config_fd >= 0 && FD_ISSET(config_fd, &rfds)) config_event();
+
+        /* Collect the ready terminals first: reading one may close it */
+        int nready = 0;
+        for (int i = 0; i < ntabs && !throttled; i++) {
+            for (int p = 0; p < tabs[i].npanes; p++) {
+                if (!tabs[i].panes[p]->hung_up && FD_ISSET(tabs[i].panes[p]->master_fd, &rfds)) ready[nready++] = tabs[i].panes[p];
+            }
+        }
+        for (int i = 0; i < nready; i++) frame_read(ready[i]);
+
+        /* Events Xlib read while waiting for a reply */
+        if (xqueued()) xevent();
+
+        if (frame_wait() == 0) frame_draw();
     }
 }
 
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--config file] [--shm name] [--log file [--log-timing file]]\n"
+                    "       [--io-uring] [--backpressure drain|throttle|auto] [--debug-x]\n"
+                    "       [command [args ...]]\n", argv0);
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
-    const char *cmd = (argc > 1) ? argv[1] : NULL;
-    char **args = (argc > 1) ? &argv[1] : NULL;
+    const char *config = NULL;
+    int i;
 
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            config = argv[++i];
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            log_name = argv[++i];
+        } else if (strcmp(argv[i], "--log-timing") == 0 && i + 1 < argc) {
+            log_timing_name = argv[++i];
+        } else if (strcmp(argv[i], "--backpressure") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "drain") == 0) bp_policy = BP_DRAIN;
+            else if (strcmp(argv[i], "throttle") == 0) bp_policy = BP_THROTTLE;
+            else if (strcmp(argv[i], "auto") == 0) bp_policy = BP_AUTO;
+            else usage(argv[0]);
+            bp_throttle = bp_policy == BP_THROTTLE;
+        } else if (strcmp(argv[i], "--debug-x") == 0) {
+            debug_x = 1;
+#ifdef IOURING
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            use_uring = 1;
+#endif
+        } else {
+            usage(argv[0]);
+        }
+    }
+    const char *cmd = (i < argc) ? argv[i] : NULL;
+    char **args = (i < argc) ? &argv[i] : NULL;
+
+    if (log_timing_name && !log_name) usage(argv[0]);
+
+    setlocale(LC_CTYPE, "");
+    sig_init();
+    config_init(config);
+    if (shm_name) shm_init();
+    if (log_name) log_init();
     xinit();
-    ptynew(cmd, args);
-    ttyresize(xw.col, xw.row);
+    key_init();
+    tab_new(cmd, args);
+    xresize(xw.col, xw.row);
     run();
 
     xfree();
-    if (master_fd >= 0) close(master_fd);
+    for (int i = 0; i < ntabs; i++) {
+        for (int p = 0; p < tabs[i].npanes; p++) close(tabs[i].panes[p]->master_fd);
+    }
     return 0;
 }
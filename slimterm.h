@@ -5,7 +5,81 @@
 
 #define MAX_COLS 256
 #define MAX_ROWS 128
-#define SCROLLBACK_SIZE 1000
+#define LOG_RING_SLOTS 64 /* PTY reads buffered for the session log */
+#define LOG_CHUNK_SIZE 8192
+#define ESCAPE_BUF_SIZE 8192
+#define MAX_TABS 16
+#define MAX_PANES 4 /* Terminals in one tab */
+#define KITTY_STACK_SIZE 8 /* Kitty keyboard flag stack depth per screen */
+#define SIXEL_PALETTE_SIZE 256
+#define IMAGE_MAX_SIZE 4096 /* Largest image side, in pixels */
+#define KITTY_CHUNK_MAX (4 << 20) /* Largest kitty graphics escape */
+#define SIXEL_MAX_PARAMS 5
+#define BOX_SLOTS 166 /* Characters drawn procedurally, see box_slot */
+#define FONT_CACHE_SIZE 4 /* Font sizes kept open for zooming */
+#define MAX_SHORTCUTS 64
+#define MAX_SCROLL_AXES 8 /* Smooth scrolling valuators tracked */
+#define XCB_QUEUE_SIZE 64 /* Events looked at ahead while parsing */
+
+/* Kitty keyboard protocol progressive enhancement flags */
+#define KITTY_DISAMBIGUATE (1 << 0)
+#define KITTY_EVENT_TYPES (1 << 1)
+#define KITTY_ALTERNATE_KEYS (1 << 2)
+#define KITTY_ALL_KEYS (1 << 3)
+#define KITTY_ASSOCIATED_TEXT (1 << 4)
+#define KITTY_ALL_FLAGS 0x1f
+
+/* Present events a frame waits for before the next one is drawn */
+#define PRESENT_COMPLETE 1
+#define PRESENT_IDLE 2
+
+/* Key modifiers, numbered like xterm's modifier parameter minus one */
+#define KEYMOD_SHIFT 1
+#define KEYMOD_ALT 2
+#define KEYMOD_CTRL 4
+
+/* Shortcut actions, see action_names */
+enum {
+    ACT_NONE, ACT_COPY, ACT_PASTE, ACT_SCROLL, ACT_NEW_TAB, ACT_SPLIT,
+    ACT_SELECT_TAB, ACT_FOCUS_PANE, ACT_ZOOM, ACT_LAST
+};
+
+/* A key bound to an action; the keysym is lower case */
+typedef struct {
+    int mods;
+    KeySym keysym;
+    int action;
+    int arg;
+} Shortcut;
+
+/* Atoms interned at startup, see atom_names */
+enum { ATOM_CLIPBOARD, ATOM_RESOURCE_MANAGER, ATOM_LAST };
+
+/* Backpressure policies, see BACKPRESSURE in config.h */
+enum { BP_DRAIN, BP_THROTTLE, BP_AUTO };
+
+#ifdef XINPUT2
+/* A vertical scroll valuator of a pointer */
+typedef struct {
+    int device; /* Master pointer reporting it */
+    int number; /* Valuator number */
+    double increment; /* Change of one wheel step */
+    double last; /* Value last seen */
+} ScrollAxis;
+#endif
+
+/* A font opened at one size and DPI, with what is drawn from it */
+typedef struct {
+    XftFont *font;
+    double size; /* In points */
+    double dpi;
+    unsigned long used; /* Last selected, for LRU eviction */
+    int width, height; /* Cell size */
+    /* Box-drawing masks, one cell-sized slot per character */
+    Pixmap box_pixmap;
+    Picture box_mask;
+    unsigned char box_done[BOX_SLOTS];
+} FontSet;
 
 typedef struct {
     Display *dpy;
@@ -13,14 +87,104 @@ typedef struct {
     XftDraw *draw;
     XftFont *font;
     XftColor colors[16]; /* 16 colors: 0-7 normal, 8-15 bright */
+    Picture fills[16]; /* The same colors as XRender sources */
+    XftColor bg; /* Default background with BACKGROUND_ALPHA applied */
+    Visual *visual;
+    Colormap colormap;
+    int depth;
+    GC gc; /* For copying the pixmap to the window */
     int w, h;
     int col, row;
     int border;
     int font_width, font_height;
+    int focused;
+    Atom atoms[ATOM_LAST];
     /* For double-buffering */
     Pixmap pixmap;
+    FontSet fonts[FONT_CACHE_SIZE]; /* Recently used sizes */
+    FontSet *fontset; /* The one in use, whose font and cell size follow */
+    double font_size; /* Size font_name asks for, in points */
+    double dpi; /* Fonts and the border are scaled to it */
+    int dpi_stale; /* RESOURCE_MANAGER changed, see xrescale */
+    /* Input method */
+    XIM xim;
+    XIC xic;
+    XPoint spot; /* Preedit spot last sent to the input method */
+    XVaNestedList spotlist;
+#ifdef XCB
+    xcb_connection_t *xc; /* Xlib's connection, whose events XCB reads */
+    xcb_generic_event_t *xcb_queue[XCB_QUEUE_SIZE]; /* Events taken off XCB's queue early */
+    int xcb_queued;
+    xcb_get_property_cookie_t paste; /* Selection property being read */
+    int paste_pending;
+#endif
+#ifdef XINPUT2
+    int xi; /* XInputExtension opcode, 0 if unavailable */
+    ScrollAxis scroll_axes[MAX_SCROLL_AXES];
+    int nscroll_axes;
+    double scroll_rest; /* Pixels scrolled but not applied yet */
+#endif
+#ifdef PRESENT
+    int present; /* Present extension opcode, 0 if unavailable */
+    int present_pending; /* PRESENT_COMPLETE and PRESENT_IDLE still due */
+    uint32_t present_serial;
+    uint64_t present_msc, present_ust; /* Last completed frame */
+    double present_period; /* Refresh period in ms */
+#endif
 } XWindow;
 
+/* A decoded image, shared by the tiles that display it */
+typedef struct {
+    uint32_t *pixels; /* Premultiplied ARGB, NULL once uploaded */
+    int width, height;
+    int refs; /* Tiles showing the image, plus the kitty store */
+    unsigned int id; /* Kitty image id, 0 for sixel */
+    unsigned long used; /* Last placed or drawn, for LRU eviction */
+    Pixmap pixmap; /* Server copy, created on first display */
+    Picture picture;
+} Image;
+
+/* One text row's strip of an image, anchored to an absolute line so it
+ * scrolls with the text and is freed when that line is evicted */
+typedef struct {
+    Image *img;
+    long long line; /* Lines scrolled off the buffer before this one */
+    int col; /* Leftmost column */
+    int src_x, src_y, src_w, src_h; /* The strip within the image */
+    unsigned int pid; /* Kitty placement id */
+    int alt; /* On the alternate screen */
+} ImageTile;
+
+/* Sixel decoder state */
+typedef struct {
+    uint32_t *pixels; /* Canvas, cap_w x cap_h */
+    int cap_w, cap_h;
+    int width, height; /* Extent actually drawn */
+    int x, y; /* Position, y is the top of the current band */
+    int color;
+    int repeat;
+    int transparent;
+    char cmd; /* '#', '!' or '"' while reading its parameters */
+    int params[SIXEL_MAX_PARAMS], nparams;
+    uint32_t palette[SIXEL_PALETTE_SIZE];
+} Sixel;
+
+/* Kitty graphics command; the keys of the first chunk apply to all */
+typedef struct {
+    char action, medium, del, compression; /* a, t, d, o */
+    int format, quiet, more, cursor; /* f, q, m, C */
+    unsigned int id, pid; /* i, p */
+    int width, height; /* s, v: size of raw pixel data */
+    int x, y, w, h; /* Source rectangle */
+    size_t size, offset; /* S, O: part of a file or shared memory */
+    unsigned char *data; /* Decoded payload */
+    size_t len, cap;
+    const char *error; /* First error, reported when complete */
+} KittyCmd;
+
+/* Where the cursor goes after an image is placed */
+enum { IMG_CURSOR_BELOW, IMG_CURSOR_AFTER, IMG_CURSOR_STAY };
+
 typedef struct {
     char data[MAX_ROWS][MAX_COLS];
     int fg[MAX_ROWS][MAX_COLS];
@@ -28,18 +192,115 @@ typedef struct {
     char alt_data[MAX_ROWS][MAX_COLS];
     int alt_fg[MAX_ROWS][MAX_COLS];
     int alt_bg[MAX_ROWS][MAX_COLS];
-    char scrollback[SCROLLBACK_SIZE][MAX_COLS];
-    int scrollback_fg[SCROLLBACK_SIZE][MAX_COLS];
-    int scrollback_bg[SCROLLBACK_SIZE][MAX_COLS];
+    char (*scrollback)[MAX_COLS]; /* Ring of scrollback_size lines */
+    int (*scrollback_fg)[MAX_COLS];
+    int (*scrollback_bg)[MAX_COLS];
+    int scrollback_size;
     int row, col;
     int alt_row, alt_col;
     int scroll_top, scroll_bottom;
     int scrollback_pos, scrollback_len;
     int scroll_offset;
+    int scroll_frac; /* Pixels the view is moved down from scroll_offset */
+    int new_lines; /* Output below the view since it left the bottom */
     int use_alt_buffer;
     int sel_start_row, sel_start_col;
     int sel_end_row, sel_end_col;
     int selecting;
+    long long lines_scrolled, alt_lines_scrolled; /* For anchoring images */
+    ImageTile *tiles;
+    int ntiles, tiles_cap;
+    Image **kitty_store; /* Images transmitted by id */
+    int kitty_nstored, kitty_store_cap;
+    int x, y; /* Position of the pane in the window, in cells */
+    int cols, rows; /* Size of the pane */
+    int cell_w, cell_h; /* Size of a cell in pixels, for images */
+
+    /* Child process */
+    unsigned int id; /* Names the terminal in io_uring requests */
+    int master_fd; /* Master side of the PTY */
+    int log_fd, log_timing_fd; /* Session log files, -1 if not logged */
+    struct timespec log_last; /* Time of the last chunk logged */
+    pid_t pid;
+    int ur_armed; /* A read is queued on io_uring */
+    int hung_up; /* The slave side closed; waiting for the child to exit */
+    struct termios tio; /* Line discipline settings, see ttyintr */
+    struct timespec tio_time; /* When tio was read */
+
+    /* Parser state */
+    char escape_buf[ESCAPE_BUF_SIZE];
+    int escape_len;
+    int in_escape;
+    int in_str; /* Inside a control string, and which kind */
+    Sixel sixel; /* Sixel image being decoded */
+    char *apc_buf; /* Application program command being read */
+    size_t apc_len, apc_cap;
+    KittyCmd kgr; /* Kitty graphics command, kept across chunks */
+
+    /* Modes */
+    int current_fg, current_bg;
+    int saved_row, saved_col; /* For \033 7 and \033 8 */
+    const unsigned char *charsets[4]; /* G0-G3 translation tables */
+    int gl; /* Set invoked into GL by SI, SO, LS2 or LS3 */
+    int single_shift; /* Set for the next character only (SS2, SS3), or -1 */
+    const unsigned char *saved_charsets[4];
+    int saved_gl;
+    int wrap; /* Line wrapping */
+    int mouse_enabled;
+    int mouse_mode; /* Mouse tracking mode */
+    int appcursor; /* Application cursor keys (DECCKM) */
+    int appkeypad; /* Application keypad (DECKPAM) */
+    int modify_other_keys; /* xterm modifyOtherKeys level */
+    int focus_report; /* Report focus changes (?1004) */
+    int kitty_keys[2][KITTY_STACK_SIZE]; /* Kitty keyboard flags per screen */
+    int kitty_depth[2];
 } Term;
 
+/* A tab: terminals sharing the window, side by side or stacked */
+typedef struct {
+    Term *panes[MAX_PANES];
+    int npanes;
+    int focus; /* Index of the pane given input */
+    int stacked; /* Panes are stacked top to bottom */
+} Tab;
+
+/* A PTY read queued for the session log writer */
+typedef struct {
+    char buf[LOG_CHUNK_SIZE];
+    size_t len;
+    int fd, timing_fd; /* Log files of the terminal read, timing_fd -1 without --log-timing */
+    double delay; /* Seconds since the terminal's previous chunk, with --log-timing */
+    int close; /* Close the files after writing */
+} LogChunk;
+
+/* Shared-memory screen published with --shm for external tools.
+ * The writer bumps seq to an odd value, updates the segment and bumps
+ * it back to even; a reader copies what it needs and retries if seq
+ * was odd or changed meanwhile. Cells are row-major with `stride`
+ * cells per row, of which only `cols` are in use. */
+#define SHM_MAGIC 0x534c4d54 /* "SLMT" */
+#define SHM_VERSION 1
+
+#define SHM_MODE_ALTSCREEN (1 << 0)
+#define SHM_MODE_WRAP (1 << 1)
+#define SHM_MODE_APPCURSOR (1 << 2)
+#define SHM_MODE_APPKEYPAD (1 << 3)
+
+typedef struct {
+    uint32_t ch; /* Character, 0 for an empty cell */
+    uint16_t fg, bg; /* Color indices */
+} ShmCell;
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t seq; /* Seqlock counter */
+    uint32_t modes; /* SHM_MODE_* flags */
+    uint64_t generation; /* Incremented once per published frame */
+    uint16_t rows, cols, stride;
+    uint16_t cur_row, cur_col;
+    uint16_t mouse_mode; /* Active mouse tracking mode, 0 if off */
+    int32_t scroll_offset; /* Scrollback view offset, <= 0 */
+    ShmCell cells[MAX_ROWS * MAX_COLS];
+} ShmScreen;
+
 #endif
@@ -0,0 +1,231 @@
+/* slimterm tests: feed escape sequences to a terminal buffer and check
+ * the result. Built against slimterm.c with its main renamed; no X
+ * connection is made. Run with make check. */
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+/* Key events carry no display here: the lookups return what the test
+ * pressed instead */
+static KeySym test_keysym, test_base;
+static const char *test_text;
+
+static int test_lookup_string(XKeyEvent *e, char *buf, int size, KeySym *keysym, XComposeStatus *status) {
+    int len = strlen(test_text);
+
+    memcpy(buf, test_text, len < size ? len : size);
+    if (keysym) *keysym = test_keysym;
+    return len;
+}
+
+static KeySym test_lookup_keysym(XKeyEvent *e, int index) {
+    return test_base;
+}
+
+#define XLookupString test_lookup_string
+#define XLookupKeysym test_lookup_keysym
+#define main slimterm_main
+#include "slimterm.c"
+#undef main
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+        failed = 1; \
+    } \
+} while (0)
+
+static Term *test_term(void) {
+    Term *t = xmalloc(sizeof(Term));
+    memset(t, 0, sizeof(Term));
+    term_init(t);
+    t->rows = 24;
+    t->cols = 80;
+    t->scroll_bottom = t->rows - 1;
+    t->cell_w = 8;
+    t->cell_h = 16;
+    return t;
+}
+
+static void feed(Term *t, const char *s) {
+    term_write(t, s, strlen(s));
+}
+
+static int key_pipe[2] = {-1, -1};
+
+/* Make a terminal the focused one, writing to a pipe */
+static Term *key_term(void) {
+    Term *t = test_term();
+
+    if (key_pipe[0] < 0) {
+        pipe(key_pipe);
+        fcntl(key_pipe[0], F_SETFL, O_NONBLOCK);
+        key_init();
+    }
+    t->master_fd = key_pipe[1];
+    tabs[0].panes[0] = t;
+    tabs[0].npanes = 1;
+    ntabs = 1;
+    return t;
+}
+
+/* Press a key with base keysym base, producing keysym and text in
+ * state, and return what was sent to the terminal */
+static const char *press(KeySym base, KeySym keysym, const char *text, unsigned int state) {
+    static char buf[64];
+    XKeyEvent e = {.type = KeyPress, .keycode = 38, .state = state};
+
+    test_base = base;
+    test_keysym = keysym;
+    test_text = text;
+    kpress(&e);
+    ssize_t n = read(key_pipe[0], buf, sizeof(buf) - 1);
+    buf[n > 0 ? n : 0] = '\0';
+    return buf;
+}
+
+/* Special keys come from the table, with their modifiers and modes */
+static void test_key_table(void) {
+    Term *t = key_term();
+
+    CHECK(!strcmp(press(XK_Up, XK_Up, "", 0), "\033[A"));
+    CHECK(!strcmp(press(XK_Up, XK_Up, "", ControlMask), "\033[1;5A"));
+    CHECK(!strcmp(press(XK_Up, XK_Up, "", Mod1Mask), "\033[1;3A"));
+    CHECK(!strcmp(press(XK_F5, XK_F5, "", ShiftMask), "\033[15;2~"));
+    CHECK(!strcmp(press(XK_BackSpace, XK_BackSpace, "\177", ControlMask), "\b"));
+    CHECK(!strcmp(press(XK_BackSpace, XK_BackSpace, "\177", Mod1Mask), "\033\177"));
+    CHECK(!strcmp(press('c', 'c', "\003", ControlMask), "\003"));
+    CHECK(!strcmp(press('a', 'a', "a", Mod1Mask), "\033a"));
+
+    feed(t, "\033[?1h"); /* Application cursor keys */
+    CHECK(!strcmp(press(XK_Up, XK_Up, "", 0), "\033OA"));
+    CHECK(!strcmp(press(XK_Up, XK_Up, "", ControlMask), "\033[1;5A"));
+
+    CHECK(!strcmp(press(XK_KP_5, XK_KP_5, "5", 0), "5"));
+    feed(t, "\033="); /* Application keypad */
+    CHECK(!strcmp(press(XK_KP_5, XK_KP_5, "5", 0), "\033Ou"));
+    CHECK(!strcmp(press(XK_KP_Enter, XK_KP_Enter, "\r", 0), "\033OM"));
+    CHECK(!strcmp(press(XK_KP_Enter, XK_KP_Enter, "\r", ControlMask), "\033O5M"));
+}
+
+/* DCS strings ending in q with an intermediate byte are not sixel */
+static void test_dcs_not_sixel(void) {
+    Term *t = test_term();
+
+    feed(t, "\033P$q\"q\033\\"); /* DECRQSS */
+    feed(t, "\033P+q544e\033\\"); /* XTGETTCAP */
+    CHECK(t->ntiles == 0);
+    CHECK(t->row == 0 && t->col == 0);
+
+    feed(t, "\033P0;1q\"1;1;6;6#1~~~~~~\033\\");
+    CHECK(t->ntiles == 1);
+    CHECK(t->row == 1);
+}
+
+/* Send a kitty graphics command transmitting a 1x1 RGBA image from a file */
+static void feed_kitty_file(Term *t, const char *path) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char buf[PATH_MAX * 2] = "\033_Ga=T,f=32,s=1,v=1,t=f;";
+    size_t n = strlen(buf), len = strlen(path);
+
+    for (size_t i = 0; i < len; i += 3) {
+        unsigned v = (unsigned char)path[i] << 16;
+        if (i + 1 < len) v |= (unsigned char)path[i + 1] << 8;
+        if (i + 2 < len) v |= (unsigned char)path[i + 2];
+        buf[n++] = digits[v >> 18];
+        buf[n++] = digits[(v >> 12) & 63];
+        buf[n++] = i + 1 < len ? digits[(v >> 6) & 63] : '=';
+        buf[n++] = i + 2 < len ? digits[v & 63] : '=';
+    }
+    strcpy(buf + n, "\033\\");
+    feed(t, buf);
+}
+
+/* Kitty file transmission reads regular files only, without blocking */
+static void test_kitty_file(void) {
+    char dir[] = "/tmp/slimterm-test-XXXXXX", path[64];
+    Term *t = test_term();
+
+    if (!mkdtemp(dir)) return;
+    snprintf(path, sizeof(path), "%s/fifo", dir);
+    mkfifo(path, 0600);
+    feed_kitty_file(t, path); /* Would hang if the FIFO were opened */
+    CHECK(t->ntiles == 0);
+    unlink(path);
+
+    feed_kitty_file(t, "/dev/zero");
+    CHECK(t->ntiles == 0);
+
+    snprintf(path, sizeof(path), "%s/pixel", dir);
+    FILE *f = fopen(path, "w");
+    fwrite("\xff\x00\x00\xff", 1, 4, f);
+    fclose(f);
+    feed_kitty_file(t, path);
+    CHECK(t->ntiles == 1);
+    unlink(path);
+    rmdir(dir);
+}
+
+/* ESC ( 0 and SO/SI switch to DEC special graphics and back */
+static void test_dec_charsets(void) {
+    Term *t = test_term();
+
+    feed(t, "\033(0qx\033(Bq");
+    CHECK(cell_rune(t->data[0][0]) == 0x2500);
+    CHECK(cell_rune(t->data[0][1]) == 0x2502);
+    CHECK(t->data[0][2] == 'q');
+
+    feed(t, "\r\n\033)0\016q\017q");
+    CHECK(cell_rune(t->data[1][0]) == 0x2500);
+    CHECK(t->data[1][1] == 'q');
+
+    /* Copied as printable stand-ins, never as control characters */
+    for (int i = 1; i < 32; i++) CHECK((unsigned char)dec_latin1[i] >= 32);
+}
+
+/* With autowrap off, text past the margin overwrites the last column */
+static void test_nowrap(void) {
+    Term *t = test_term();
+
+    feed(t, "\033[?7l");
+    for (int i = 0; i < 79; i++) feed(t, "a");
+    feed(t, "bcd");
+    CHECK(t->data[0][78] == 'a');
+    CHECK(t->data[0][79] == 'd');
+    CHECK(t->row == 0);
+}
+
+/* Kitty keyboard flags: disambiguate keeps text and Enter legacy and
+ * reports lock keys only with all keys */
+static void test_kitty_keys(void) {
+    Term *t = key_term();
+
+    feed(t, "\033[>1u");
+    CHECK(!strcmp(press(XK_Escape, XK_Escape, "\033", 0), "\033[27u"));
+    CHECK(!strcmp(press('c', 'c', "\003", ControlMask), "\033[99;5u"));
+    CHECK(!strcmp(press('a', 'a', "a", 0), "a"));
+    CHECK(!strcmp(press('a', 'A', "A", LockMask), "A"));
+    CHECK(!strcmp(press(XK_Return, XK_Return, "\r", 0), "\r"));
+    CHECK(!strcmp(press(XK_Caps_Lock, XK_Caps_Lock, "", 0), ""));
+
+    feed(t, "\033[=9u"); /* Disambiguate and all keys */
+    CHECK(!strcmp(press('a', 'a', "a", 0), "\033[97u"));
+    CHECK(!strcmp(press('a', 'A', "A", LockMask), "\033[97;65u"));
+    CHECK(!strcmp(press(XK_Return, XK_Return, "\r", 0), "\033[13u"));
+    CHECK(!strcmp(press(XK_Caps_Lock, XK_Caps_Lock, "", 0), "\033[57358u"));
+
+    feed(t, "\033[<u");
+    CHECK(!strcmp(press(XK_Escape, XK_Escape, "\033", 0), "\033"));
+}
+
+int main(void) {
+    test_dcs_not_sixel();
+    test_kitty_file();
+    test_dec_charsets();
+    test_nowrap();
+    test_key_table();
+    test_kitty_keys();
+    return failed;
+}